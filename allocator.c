@@ -0,0 +1,289 @@
+#include "allocator.h"
+#include <stdlib.h>
+#include <string.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#define PAGE_HEADER ((sizeof(Page) + SIZE_CLASS_STEP - 1) & ~(size_t)(SIZE_CLASS_STEP - 1))
+
+// array pages and object pages are kept apart, an object page only holds objects
+static Page*pages = NULL;
+static Page*available[SIZE_CLASSES];
+static Page*objectPageList = NULL;
+static Page*objectAvailable[SIZE_CLASSES];
+// object pages waiting for the sweep, linked through their available links
+static Page*unswept[SIZE_CLASSES + 1];
+
+static inline int sizeClassOf(size_t size){
+    return (int)((size - 1) / SIZE_CLASS_STEP);
+}
+
+static inline Page** pageListOf(bool holdsObjects){
+    return holdsObjects?&objectPageList:&pages;
+}
+
+static inline Page** availableOf(Page*page){
+    return page->holdsObjects?&objectAvailable[page->sizeClass]:&available[page->sizeClass];
+}
+
+static void linkAvailable(Page*page){
+    Page**list = availableOf(page);
+    page->isAvailable = true;
+    page->prevAvailable = NULL;
+    page->nextAvailable = *list;
+    if(page->nextAvailable != NULL)page->nextAvailable->prevAvailable = page;
+    *list = page;
+}
+
+static void unlinkAvailable(Page*page){
+    page->isAvailable = false;
+    if(page->prevAvailable != NULL)page->prevAvailable->nextAvailable = page->nextAvailable;
+    else *availableOf(page) = page->nextAvailable;
+    if(page->nextAvailable != NULL)page->nextAvailable->prevAvailable = page->prevAvailable;
+}
+
+static void linkPage(Page*page){
+    Page**list = pageListOf(page->holdsObjects);
+    page->prev = NULL;
+    page->next = *list;
+    if(*list != NULL)(*list)->prev = page;
+    *list = page;
+}
+
+static Page* newPage(int sizeClass,bool holdsObjects){
+    Page*page = (Page*)aligned_alloc(HEAP_PAGE_SIZE,HEAP_PAGE_SIZE);
+    if(page == NULL)return NULL;
+    page->sizeClass = sizeClass;
+    page->blockSize = (sizeClass + 1) * SIZE_CLASS_STEP;
+    page->holdsObjects = holdsObjects;
+    page->isEvacuating = false;
+    page->freeList = NULL;
+    page->top = (uint8_t*)page + PAGE_HEADER;
+    page->used = 0;
+    if(holdsObjects){
+        memset(page->live,0,sizeof(page->live));
+        memset(page->marks,0,sizeof(page->marks));
+    }
+    linkPage(page);
+    linkAvailable(page);
+    return page;
+}
+
+// the object is the only block of its page, the page never has room for another
+static void* allocateLarge(size_t size){
+    size_t pageSize = (PAGE_HEADER + size + HEAP_PAGE_SIZE - 1) & ~(size_t)(HEAP_PAGE_SIZE - 1);
+    Page*page = (Page*)aligned_alloc(HEAP_PAGE_SIZE,pageSize);
+    if(page == NULL)return NULL;
+    page->sizeClass = LARGE_CLASS;
+    page->blockSize = (int)size;
+    page->holdsObjects = true;
+    page->isAvailable = false;
+    page->isEvacuating = false;
+    page->freeList = NULL;
+    page->top = (uint8_t*)page + pageSize;
+    page->used = 1;
+    memset(page->live,0,sizeof(page->live));
+    memset(page->marks,0,sizeof(page->marks));
+    linkPage(page);
+    return (uint8_t*)page + PAGE_HEADER;
+}
+
+static void releasePage(Page*page){
+    if(page->isAvailable)unlinkAvailable(page);
+    if(page->prev != NULL)page->prev->next = page->next;
+    else *pageListOf(page->holdsObjects) = page->next;
+    if(page->next != NULL)page->next->prev = page->prev;
+    free(page);
+}
+
+static inline bool hasRoom(Page*page){
+    return page->freeList != NULL || page->top + page->blockSize <= (uint8_t*)page + HEAP_PAGE_SIZE;
+}
+
+static void* allocateSmall(int sizeClass,bool holdsObjects){
+    Page*page = holdsObjects?objectAvailable[sizeClass]:available[sizeClass];
+    if(page == NULL && (page = newPage(sizeClass,holdsObjects)) == NULL)return NULL;
+    void*block;
+    if(page->freeList != NULL){
+        block = page->freeList;
+        page->freeList = *(void**)block;
+    }
+    else{
+        block = page->top;
+        page->top += page->blockSize;
+    }
+    page->used++;
+    if(!hasRoom(page))unlinkAvailable(page);
+    return block;
+}
+
+// puts the block back on its page's free list, returns true when the page was left empty
+static bool returnSmall(Page*page,void*block){
+    *(void**)block = page->freeList;
+    page->freeList = block;
+    page->used--;
+    if(!page->isAvailable){
+        linkAvailable(page);
+        return false;
+    }
+    return page->used == 0;
+}
+
+static void releaseEmptyPage(Page*page){
+    // an empty page is kept only when it's the last one of its size class with room
+    if(page->used == 0 && (*availableOf(page) != page || page->nextAvailable != NULL)){
+        releasePage(page);
+    }
+}
+
+void* allocateObjectBlock(size_t size){
+    void*block = size > SMALL_BLOCK_MAX?allocateLarge(size):allocateSmall(sizeClassOf(size),true);
+    if(block == NULL)return NULL;
+    PAGE_OF(block)->live[BLOCK_WORD(block)] |= BLOCK_BIT(block);
+    return block;
+}
+
+void freeObjectBlock(void*block){
+    Page*page = PAGE_OF(block);
+    page->live[BLOCK_WORD(block)] &= ~BLOCK_BIT(block);
+    if(page->sizeClass == LARGE_CLASS)page->used = 0;
+    else returnSmall(page,block);
+}
+
+void beginSweep(){
+    for(Page*page = objectPageList;page != NULL;page = page->next){
+        if(page->isAvailable)unlinkAvailable(page);
+        page->prevAvailable = NULL;
+        page->nextAvailable = unswept[page->sizeClass];
+        unswept[page->sizeClass] = page;
+    }
+}
+
+Page* takeUnsweptPage(size_t size){
+    int sizeClass = 0;
+    if(size != 0){
+        sizeClass = sizeClassOf(size);
+    }
+    else{
+        while(sizeClass <= LARGE_CLASS && unswept[sizeClass] == NULL)sizeClass++;
+        if(sizeClass > LARGE_CLASS)return NULL;
+    }
+    Page*page = unswept[sizeClass];
+    if(page != NULL)unswept[sizeClass] = page->nextAvailable;
+    return page;
+}
+
+bool needsObjectPage(size_t size){
+    return size <= SMALL_BLOCK_MAX && objectAvailable[sizeClassOf(size)] == NULL;
+}
+
+void sweptPage(Page*page){
+    if(page->sizeClass == LARGE_CLASS){
+        if(page->used == 0)releasePage(page);
+        return;
+    }
+    // freeing the first dead block already made it available
+    if(!page->isAvailable && hasRoom(page))linkAvailable(page);
+    releaseEmptyPage(page);
+}
+
+Page* objectPages(){
+    return objectPageList;
+}
+
+int pageBlocks(Page*page){
+    if(page->sizeClass == LARGE_CLASS)return 1;
+    return (int)((HEAP_PAGE_SIZE - PAGE_HEADER) / page->blockSize);
+}
+
+void beginEvacuation(Page*page){
+    page->isEvacuating = true;
+    if(page->isAvailable)unlinkAvailable(page);
+}
+
+void releaseEvacuatedPage(Page*page){
+    releasePage(page);
+}
+
+void returnFreeMemory(){
+    #ifdef __GLIBC__
+    malloc_trim(0);
+    #endif
+}
+
+#ifdef SYSTEM_MALLOC
+
+size_t blockSize(size_t size){
+    return size;
+}
+
+void* resizeBlock(void*block,size_t oldSize,size_t newSize){
+    return realloc(block,newSize);
+}
+
+void freeBlock(void*block,size_t size){
+    free(block);
+}
+
+#else
+
+size_t blockSize(size_t size){
+    if(size == 0 || size > SMALL_BLOCK_MAX)return size;
+    return (size_t)(sizeClassOf(size) + 1) * SIZE_CLASS_STEP;
+}
+
+static void freeSmall(void*block){
+    Page*page = PAGE_OF(block);
+    if(returnSmall(page,block))releaseEmptyPage(page);
+}
+
+void* resizeBlock(void*block,size_t oldSize,size_t newSize){
+    if(oldSize > SMALL_BLOCK_MAX && newSize > SMALL_BLOCK_MAX){
+        return realloc(block,newSize);
+    }
+    if(oldSize != 0 && oldSize <= SMALL_BLOCK_MAX && newSize <= SMALL_BLOCK_MAX
+        && sizeClassOf(oldSize) == sizeClassOf(newSize)){
+        return block;
+    }
+
+    void*result;
+    if(newSize <= SMALL_BLOCK_MAX){
+        result = allocateSmall(sizeClassOf(newSize),false);
+    }
+    else{
+        result = malloc(newSize);
+    }
+    if(result == NULL)return NULL;
+    if(oldSize != 0){
+        memcpy(result,block,oldSize < newSize?oldSize:newSize);
+        freeBlock(block,oldSize);
+    }
+    return result;
+}
+
+void freeBlock(void*block,size_t size){
+    if(block == NULL)return;
+    if(size > SMALL_BLOCK_MAX)free(block);
+    else freeSmall(block);
+}
+
+#endif
+
+void freePages(){
+    for(int kind = 0;kind < 2;kind++){
+        Page**list = pageListOf(kind == 1);
+        while(*list != NULL){
+            Page*next = (*list)->next;
+            free(*list);
+            *list = next;
+        }
+    }
+    for(int i = 0;i < SIZE_CLASSES;i++){
+        available[i] = NULL;
+        objectAvailable[i] = NULL;
+    }
+    for(int i = 0;i <= LARGE_CLASS;i++){
+        unswept[i] = NULL;
+    }
+}
\ No newline at end of file
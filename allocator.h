@@ -0,0 +1,102 @@
+#ifndef allocator_h
+#define allocator_h
+
+#include "common.h"
+
+/*
+    blocks up to SMALL_BLOCK_MAX bytes are carved out of HEAP_PAGE_SIZE pages, each page holding blocks of a
+    single size class, larger ones come from malloc. reallocate() is the only caller, build with
+    -DSYSTEM_MALLOC to send everything to malloc (for sanitizers and valgrind).
+
+    old objects get pages of their own whatever the build, the collector finds them through the pages' bitmaps
+    instead of a list threaded through their headers.
+*/
+#define HEAP_PAGE_SIZE (64 * 1024)
+#define SIZE_CLASS_STEP 16
+// an instance with SHAPE_MAX_FIELDS inline fields has to fit
+#define SMALL_BLOCK_MAX 1024
+#define SIZE_CLASSES (SMALL_BLOCK_MAX / SIZE_CLASS_STEP)
+// a page bitmap has a bit for each SIZE_CLASS_STEP bytes of the page
+#define PAGE_BITMAP_WORDS (HEAP_PAGE_SIZE / SIZE_CLASS_STEP / 64)
+// size class of an object page holding a single object larger than SMALL_BLOCK_MAX, it spans as many
+// HEAP_PAGE_SIZE as the object needs and only its first one has a header
+#define LARGE_CLASS SIZE_CLASSES
+
+typedef struct Page Page;
+
+// header at the start of every page, blocks follow it
+struct Page{
+    // every page of the same kind, so they can be freed with the VM and the sweep can walk the object pages
+    Page*prev;
+    Page*next;
+    // pages of the same kind and size class that have a free block, or object pages waiting for the sweep
+    Page*prevAvailable;
+    Page*nextAvailable;
+    bool isAvailable;
+    // blocks are objects, handed out by allocateObjectBlock()
+    bool holdsObjects;
+    // its objects are being moved out by a compaction, nothing is allocated in it
+    bool isEvacuating;
+    // freed blocks, each holds a pointer to the next one
+    void*freeList;
+    // blocks from here to the end of the page were never handed out
+    uint8_t*top;
+    int sizeClass;
+    int blockSize;
+    // blocks handed out and not freed
+    int used;
+    // object pages only: the blocks holding an object and the objects the running cycle marked
+    uint64_t live[PAGE_BITMAP_WORDS];
+    uint64_t marks[PAGE_BITMAP_WORDS];
+};
+
+// pages are aligned to their size, the page of a block is found by masking its address
+#define PAGE_OF(block) ((Page*)((uintptr_t)(block) & ~(uintptr_t)(HEAP_PAGE_SIZE - 1)))
+#define BLOCK_INDEX(block) (((uintptr_t)(block) & (HEAP_PAGE_SIZE - 1)) / SIZE_CLASS_STEP)
+// the word and the bit standing for a block in the bitmaps of its page
+#define BLOCK_WORD(block) (BLOCK_INDEX(block) / 64)
+#define BLOCK_BIT(block) ((uint64_t)1 << (BLOCK_INDEX(block) % 64))
+// the block bit of word stands for
+#define PAGE_BLOCK(page,word,bit) ((void*)((uint8_t*)(page) + ((word) * 64 + (bit)) * SIZE_CLASS_STEP))
+
+// bytes a block of this size really takes, what vm.bytesAllocated counts
+size_t blockSize(size_t size);
+/*
+    returns a block of newSize bytes holding the first bytes of block, block may be NULL when oldSize is 0.
+    Returns NULL when the system is out of memory, block is left as it was.
+*/
+void* resizeBlock(void*block,size_t oldSize,size_t newSize);
+void freeBlock(void*block,size_t size);
+
+// returns a block of an object page with its live bit set, a large page of its own past SMALL_BLOCK_MAX. NULL
+// when out of memory
+void* allocateObjectBlock(size_t size);
+// clears the block's live bit, its page is kept even when it's left empty until sweptPage()
+void freeObjectBlock(void*block);
+/*
+    hands every object page to the sweep, nothing is allocated in a page until it was swept. Allocation goes
+    to the pages already swept and to new ones meanwhile.
+*/
+void beginSweep();
+// takes a page waiting for the sweep, of the size class of size or of any class when size is 0
+Page* takeUnsweptPage(size_t size);
+// no swept page of the size class of size has room, allocateObjectBlock() would start a new page. Never true
+// past SMALL_BLOCK_MAX, sweeping doesn't make room for a large object
+bool needsObjectPage(size_t size);
+// the sweep is done with the page, it is released if left empty unless it's the last one of its class with room
+void sweptPage(Page*page);
+// the object pages, linked through next
+Page* objectPages();
+// blocks the page holds when full
+int pageBlocks(Page*page);
+// takes an object page off the available list, what it holds is about to be moved elsewhere
+void beginEvacuation(Page*page);
+// frees an evacuated page along with the objects left in it
+void releaseEvacuatedPage(Page*page);
+// gives the memory of freed pages back to the system where the C library allows it
+void returnFreeMemory();
+
+// returns every page to the system, all blocks have to be freed already
+void freePages();
+
+#endif
@@ -9,6 +9,9 @@ void initChunk(Chunk *chunk){
     chunk->size = 0;
     chunk->code = NULL;
     chunk->lines = NULL;
+    chunk->caches = NULL;
+    chunk->cacheCount = 0;
+    chunk->cacheCapacity = 0;
     initValueArray(&chunk->constants);
 }
 
@@ -36,6 +39,7 @@ void freeChunk(Chunk *chunk){
     FREE_ARRAY(uint8_t,chunk->code,chunk->capacity);
     freeValueArray(&chunk->constants);
     FREE_ARRAY(int,chunk->lines,chunk->capacity);
+    FREE_ARRAY(InlineCache,chunk->caches,chunk->cacheCapacity);
     initChunk(chunk);
 }
 
@@ -45,4 +49,70 @@ int addConstant(Chunk*chunk,Value value){
     writeValueArray(&chunk->constants,value);
     pop();
     return chunk->constants.size - 1;
+}
+
+int addCache(Chunk *chunk){
+    if(chunk->cacheCount == chunk->cacheCapacity){
+        int oldCapacity = chunk->cacheCapacity;
+        chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+        GROW_SHARED_ARRAY(InlineCache,chunk->caches,oldCapacity,chunk->cacheCapacity);
+    }
+    InlineCache*cache = &chunk->caches[chunk->cacheCount];
+    cache->count = 0;
+    cache->megamorphic = false;
+    return chunk->cacheCount++;
+}
+
+int instructionLength(uint8_t opcode){
+    switch(opcode){
+        case OP_CONSTANT:
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_SET_LOCAL:
+        case OP_GET_LOCAL:
+        case OP_POPN:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_CLASS:
+        case OP_METHOD:
+            return 2;
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP:
+        case OP_LOOP:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_LESS_EQUAL:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_NOT_GREATER_EQUAL:
+        case OP_JUMP_IF_NOT_EQUAL:
+        case OP_JUMP_IF_EQUAL:
+        case OP_ADD_LOCAL_CONST:
+            return 3;
+        case OP_SET_PROPERTY:
+        case OP_GET_PROPERTY:
+        case OP_CONSTANT_LONG:
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_GET_GLOBAL_LONG:
+        case OP_SET_GLOBAL_LONG:
+        case OP_CLASS_LONG:
+        case OP_METHOD_LONG:
+        case OP_GET_LOCAL_LONG:
+        case OP_SET_LOCAL_LONG:
+        case OP_JUMP_LONG:
+        case OP_JUMP_IF_FALSE_LONG:
+        case OP_LOOP_LONG:
+            return 4;
+        case OP_INVOKE:
+        case OP_TAIL_INVOKE:
+            return 5;
+        case OP_SET_PROPERTY_LONG:
+        case OP_GET_PROPERTY_LONG:
+            return 7;
+        case OP_INVOKE_LONG:
+        case OP_TAIL_INVOKE_LONG:
+            return 8;
+        default:
+            return 1;
+    }
 }
\ No newline at end of file
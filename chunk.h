@@ -14,6 +14,15 @@ typedef enum{
     OP_JUMP_IF_FALSE,
     OP_JUMP,
     OP_LOOP,
+    // superinstructions written by the peephole pass in optimizer.c
+    OP_POP_JUMP_IF_FALSE,
+    OP_JUMP_IF_NOT_LESS,
+    OP_JUMP_IF_NOT_LESS_EQUAL,
+    OP_JUMP_IF_NOT_GREATER,
+    OP_JUMP_IF_NOT_GREATER_EQUAL,
+    OP_JUMP_IF_NOT_EQUAL,
+    OP_JUMP_IF_EQUAL,
+    OP_ADD_LOCAL_CONST,
 
     // OpCode constantIndex
     OP_CONSTANT,
@@ -45,9 +54,71 @@ typedef enum{
     OP_TRUE,
     OP_FALSE,
     OP_NIL,
+    // superinstructions written by the peephole pass in optimizer.c
+    OP_NOT_EQUAL,
+    OP_LESS_EQUAL,
+    OP_GREATER_EQUAL,
+    // specialized variants run() rewrites OP_ADD into once it has seen its operands
+    OP_ADD_NUM,
+    OP_ADD_STR,
+    // OP_CALL and OP_INVOKE right before an OP_RETURN, a function they call takes over the caller's frame
+    OP_TAIL_CALL,
+    OP_TAIL_INVOKE,
+
+    /*
+        _LONG variants of the instructions above taking a constant index, global slot or local slot, the index
+        is a 24 bit operand of 3 bytes in place of the single byte. Any other operands follow as usual, except
+        the inline cache index of the property instructions which is 24 bits wide as well.
+    */
+    OP_CONSTANT_LONG,
+    OP_DEFINE_GLOBAL_LONG,
+    OP_GET_GLOBAL_LONG,
+    OP_SET_GLOBAL_LONG,
+    OP_CLASS_LONG,
+    OP_METHOD_LONG,
+    OP_SET_PROPERTY_LONG,
+    OP_GET_PROPERTY_LONG,
+    OP_INVOKE_LONG,
+    OP_GET_LOCAL_LONG,
+    OP_SET_LOCAL_LONG,
+    OP_TAIL_INVOKE_LONG,
+
+    // jumps with a 24 bit offset, the compiler emits forward jumps in this form and optimizer.c shortens them
+    OP_JUMP_LONG,
+    OP_JUMP_IF_FALSE_LONG,
+    OP_LOOP_LONG,
 
 }OpCode;
 
+// largest constant index, global slot, local slot or cache index a _LONG instruction can hold
+#define MAX_INDEX 0xffffff
+
+// number of receiver shapes an inline cache remembers before it gives up
+#define CACHE_MAX_ENTRIES 4
+
+// what a property name resolved to for instances with one shape
+typedef struct{
+    ObjShape*shape;
+    // slot of the field in the instance's fields, unused for methods
+    int slot;
+    // shape an OP_SET_PROPERTY moves the instance to when it adds the field, NULL if the field exists
+    ObjShape*transition;
+    // method of the class the name resolved to, NULL for a field
+    ObjFunction*method;
+}CacheEntry;
+
+/*
+    inline cache of an OP_GET_PROPERTY, OP_SET_PROPERTY or OP_INVOKE instruction, the instruction
+    holds its index into the chunk's caches as a 16 bit operand, a 24 bit one for the _LONG variants
+*/
+typedef struct{
+    // entries in use: 0 means empty, 1 monomorphic, more than 1 polymorphic
+    int count;
+    // set once more than CACHE_MAX_ENTRIES shapes showed up, the instruction then always does the full lookup
+    bool megamorphic;
+    CacheEntry entries[CACHE_MAX_ENTRIES];
+}InlineCache;
+
 
 // struct for a dynamic array of bytecode
 typedef struct{
@@ -62,6 +133,10 @@ typedef struct{
     ValueArray constants;
     // dynamic array containing the line numbers where a specific bytecode came from
     int *lines;
+    // inline caches of the property instructions in this chunk
+    InlineCache*caches;
+    int cacheCount;
+    int cacheCapacity;
 
 }Chunk;
 
@@ -80,4 +155,12 @@ void freeChunk(Chunk *chunk);
 
 int addConstant(Chunk *chunk,Value value);
 
+// adds an empty inline cache to the chunk and returns its index
+
+int addCache(Chunk *chunk);
+
+// returns the size in bytes of an instruction with this opcode, operands included
+
+int instructionLength(uint8_t opcode);
+
 #endif
\ No newline at end of file
@@ -1,12 +1,16 @@
 #ifndef common_h
 #define common_h
 
-#define DEBUG_TRACE_EXECUTION
-#define DEBUG_PRINT_EXECUTION
 // #define GC_STRESS
 // #define GC_LOG
 #define NAN_BOXING
 
+// run() dispatches through a table of label addresses (GCC/Clang labels-as-values)
+// build with -DSWITCH_DISPATCH to force the portable switch loop
+#if defined(__GNUC__) && !defined(SWITCH_DISPATCH)
+#define THREADED_DISPATCH
+#endif
+
 // including the common libraries
 
 #include <stdbool.h>
@@ -4,9 +4,10 @@
 #include "value.h"
 #include "object.h"
 #include<string.h>
-#ifdef DEBUG_PRINT_EXECUTION
+#include "vm.h"
 #include "debug.h"
-#endif
+#include "optimizer.h"
+#include "memory.h"
 
 Parser parser;
 Compiler*current = NULL;
@@ -36,12 +37,83 @@ Chunk* currentChunk(){
     return &current->function->chunk;
 }
 
-uint8_t makeConstant(Value value){
+// bits identifying a constant, numbers compare by their bits so 0 and -0 get separate entries
+static uint64_t constantBits(Value value){
+    #ifdef NAN_BOXING
+    return value;
+    #else
+    if(IS_NUM(value)){
+        double number = AS_NUM(value);
+        uint64_t bits;
+        memcpy(&bits,&number,sizeof(bits));
+        return bits;
+    }
+    return (uint64_t)(uintptr_t)AS_OBJ(value);
+    #endif
+}
+
+static bool sameConstant(Value a,Value b){
+    #ifndef NAN_BOXING
+    if(a.type != b.type)return false;
+    #endif
+    return constantBits(a) == constantBits(b);
+}
+
+static ConstantEntry* findConstantEntry(ConstantEntry*entries,int capacity,Value value){
+    uint64_t bits = constantBits(value);
+    uint32_t index = (uint32_t)(bits ^ (bits >> 32)) * 2654435761u & (capacity - 1);
+    for(;;){
+        ConstantEntry*entry = &entries[index];
+        if(entry->index == -1 || sameConstant(entry->value,value))return entry;
+        index = (index + 1) & (capacity - 1);
+    }
+}
+
+static void growConstantTable(){
+    int capacity = GROW_CAPACITY(current->constantCapacity);
+    ConstantEntry*entries = ALLOCATE(ConstantEntry,capacity);
+    for(int i = 0;i < capacity;i++){
+        entries[i].index = -1;
+    }
+    for(int i = 0;i < current->constantCapacity;i++){
+        ConstantEntry*entry = &current->constants[i];
+        if(entry->index == -1)continue;
+        *findConstantEntry(entries,capacity,entry->value) = *entry;
+    }
+    FREE_ARRAY(ConstantEntry,current->constants,current->constantCapacity);
+    current->constants = entries;
+    current->constantCapacity = capacity;
+}
+
+/*
+    returns the index of the value in the chunk's constants, adding it only if it isn't there yet.
+    Constants thrown away with discarded code leave stale entries in the table, an entry only counts
+    while the chunk still holds its value at its index.
+*/
+int makeConstant(Value value){
+    ValueArray*constants = &currentChunk()->constants;
+    if(current->constantCount > 0){
+        ConstantEntry*entry = findConstantEntry(current->constants,current->constantCapacity,value);
+        if(entry->index != -1 && entry->index < constants->size
+            && sameConstant(constants->values[entry->index],value)){
+            return entry->index;
+        }
+    }
+
+    WRITE_BARRIER(&current->function->obj,value);
     int constant = addConstant(currentChunk(),value);
-    if(constant > UINT8_MAX){
+    if(constant > MAX_INDEX){
         errorAtPrevious("Too many constants for 1 chunk");
+        return 0;
+    }
+    if(current->constantCount + 1 > current->constantCapacity * 3 / 4){
+        growConstantTable();
     }
-    return (uint8_t)constant;
+    ConstantEntry*entry = findConstantEntry(current->constants,current->constantCapacity,value);
+    if(entry->index == -1)current->constantCount++;
+    entry->value = value;
+    entry->index = constant;
+    return constant;
 }
 
 void emitByte(uint8_t byte){
@@ -53,6 +125,47 @@ void emitBytes(uint8_t byte1,uint8_t byte2){
     emitByte(byte2);
 }
 
+// emits a 24 bit operand
+void emitLong(int operand){
+    emitByte((uint8_t)(operand >> 16));
+    emitByte((uint8_t)(operand >> 8));
+    emitByte((uint8_t)operand);
+}
+
+// emits an instruction taking a constant index or global slot, or its _LONG variant if the index needs more than a byte
+void emitIndexed(uint8_t instruction,uint8_t longInstruction,int index){
+    if(index <= UINT8_MAX){
+        emitBytes(instruction,(uint8_t)index);
+        return;
+    }
+    emitByte(longInstruction);
+    emitLong(index);
+}
+
+/*
+    emits a property instruction with its name, the argument count of an invoke (argCount is -1 for the others)
+    and the index of a new inline cache. The _LONG variant holds the name and the cache as 24 bit operands, it is
+    used when the name needs more than a byte or the cache more than 16 bits.
+*/
+void emitProperty(uint8_t instruction,uint8_t longInstruction,int name,int argCount){
+    int cache = addCache(currentChunk());
+    if(cache > MAX_INDEX){
+        errorAtPrevious("Too many property accesses in one function");
+        return;
+    }
+    bool isLong = name > UINT8_MAX || cache > UINT16_MAX;
+    if(isLong){
+        emitByte(longInstruction);
+        emitLong(name);
+    }
+    else{
+        emitBytes(instruction,(uint8_t)name);
+    }
+    if(argCount >= 0)emitByte((uint8_t)argCount);
+    if(isLong)emitLong(cache);
+    else emitBytes((uint8_t)(cache >> 8),(uint8_t)cache);
+}
+
 void emitReturn(){
     if(current->type == FUNC_INITIALIZER){
         emitBytes(OP_GET_LOCAL,0);
@@ -64,37 +177,147 @@ void emitReturn(){
 }
 
 void emitConstant(Value value){
-    emitBytes(OP_CONSTANT,makeConstant(value));
+    emitIndexed(OP_CONSTANT,OP_CONSTANT_LONG,makeConstant(value));
 }
 
+/*
+    forward jumps are emitted as the _LONG variant since their distance isn't known yet,
+    optimizeChunk() shortens the ones that fit in 16 bits
+*/
 int emitJump(uint8_t instruction){
     emitByte(instruction);
-    emitByte(0xff);
-    emitByte(0xff);
-    return currentChunk()->size - 2;
+    emitLong(MAX_INDEX);
+    return currentChunk()->size - 3;
 }
 
 void emitLoop(int loopStart){
-    emitByte(OP_LOOP);
+    int jump = currentChunk()->size - loopStart + 3;
+    if(jump <= UINT16_MAX){
+        emitByte(OP_LOOP);
+        emitByte((uint8_t)(jump >> 8));
+        emitByte((uint8_t)(jump));
+        return;
+    }
 
-    int jump = currentChunk()->size - loopStart + 2;
-    if(jump > UINT16_MAX){
+    jump++;
+    if(jump > MAX_INDEX){
         errorAtPrevious("Loop body too large");
     }
-    
-    emitByte((uint8_t)(jump << 8));
-    emitByte((uint8_t)(jump));
-
+    emitByte(OP_LOOP_LONG);
+    emitLong(jump);
 }
 
 void patchJump(int offset){
-    int jump = currentChunk()->size - offset - 2;
+    int jump = currentChunk()->size - offset - 3;
 
-    if(jump > UINT16_MAX){
+    if(jump > MAX_INDEX){
         errorAtPrevious("Too Much large jump");
     }
-    currentChunk()->code[offset] = (uint8_t)(jump >> 8); // MSB 
-    currentChunk()->code[offset + 1] = (uint8_t)(jump); // LSB
+    currentChunk()->code[offset] = (uint8_t)(jump >> 16);
+    currentChunk()->code[offset + 1] = (uint8_t)(jump >> 8);
+    currentChunk()->code[offset + 2] = (uint8_t)(jump);
+}
+
+// reads the value loaded by the code from start to end when that code is a single constant load
+static bool constantBetween(int start,int end,Value *value){
+    Chunk*chunk = currentChunk();
+    if(start >= end)return false;
+    switch(chunk->code[start]){
+        case OP_CONSTANT:
+            *value = chunk->constants.values[chunk->code[start + 1]];
+            return end == start + 2;
+        case OP_CONSTANT_LONG:
+            *value = chunk->constants.values[chunk->code[start + 1] << 16 | chunk->code[start + 2] << 8 | chunk->code[start + 3]];
+            return end == start + 4;
+        case OP_TRUE:
+            *value = BOOL_VAL(true);
+            return end == start + 1;
+        case OP_FALSE:
+            *value = BOOL_VAL(false);
+            return end == start + 1;
+        case OP_NIL:
+            *value = NIL_VAL;
+            return end == start + 1;
+        default:
+            return false;
+    }
+}
+
+// reads the value loaded by the code from start to the end of the chunk when it is a single constant load
+static bool constantAt(int start,Value *value){
+    return constantBetween(start,currentChunk()->size,value);
+}
+
+/*
+    throws away the code from start on, with the constants and inline caches added since the chunk had
+    constantCount and cacheCount of them. Code before start was emitted before those existed so nothing else
+    refers to them
+*/
+static void discardCode(int start,int constantCount,int cacheCount){
+    if(current->lastCall >= start)current->lastCall = -1;
+    currentChunk()->size = start;
+    currentChunk()->constants.size = constantCount;
+    currentChunk()->cacheCount = cacheCount;
+}
+
+// emits a load of a value computed at compile time
+static void emitValue(Value value){
+    if(IS_BOOL(value)){
+        emitByte(AS_BOOL(value)?OP_TRUE:OP_FALSE);
+    }
+    else if(IS_NIL(value)){
+        emitByte(OP_NIL);
+    }
+    else{
+        emitConstant(value);
+    }
+}
+
+// computes a binary operator on two constants the way run() would, false if it raises an error at runtime
+static bool foldBinary(TokenType operatorType,Value a,Value b,Value *result){
+    if(operatorType == TOKEN_EQUAL_EQUAL){
+        *result = BOOL_VAL(areEqual(a,b));
+        return true;
+    }
+    if(operatorType == TOKEN_BANG_EQUAL){
+        *result = BOOL_VAL(!areEqual(a,b));
+        return true;
+    }
+    if(operatorType == TOKEN_PLUS && IS_STRING(a) && IS_STRING(b)){
+        // both strings are constants of the chunk, so they survive a collection while the result is allocated
+        ObjString*left = AS_STRING(a);
+        ObjString*right = AS_STRING(b);
+        ObjString*string = allocateString(left->length + right->length);
+        memcpy(string->chars,left->chars,left->length);
+        memcpy(string->chars + left->length,right->chars,right->length);
+        *result = OBJ_VAL(internString(string));
+        return true;
+    }
+    if(!IS_NUM(a) || !IS_NUM(b))return false;
+
+    double x = AS_NUM(a);
+    double y = AS_NUM(b);
+    switch(operatorType){
+        case TOKEN_PLUS: *result = NUM_VAL(x + y); return true;
+        case TOKEN_MINUS: *result = NUM_VAL(x - y); return true;
+        case TOKEN_STAR: *result = NUM_VAL(x * y); return true;
+        case TOKEN_SLASH: *result = NUM_VAL(x / y); return true;
+        case TOKEN_LESS: *result = BOOL_VAL(x < y); return true;
+        case TOKEN_LESS_EQUAL: *result = BOOL_VAL(!(x > y)); return true;
+        case TOKEN_GREATER: *result = BOOL_VAL(x > y); return true;
+        case TOKEN_GREATER_EQUAL: *result = BOOL_VAL(!(x < y)); return true;
+        default: return false;
+    }
+}
+
+// appends an uninitialised local to the current function, growing its locals array when it is full
+static Local* pushLocal(){
+    if(current->localCount == current->localCapacity){
+        int oldCapacity = current->localCapacity;
+        current->localCapacity = GROW_CAPACITY(oldCapacity);
+        current->locals = GROW_ARRAY(Local,current->locals,oldCapacity,current->localCapacity);
+    }
+    return &current->locals[current->localCount++];
 }
 
 void initCompiler(Compiler *compiler,FunctionType type){
@@ -102,15 +325,24 @@ void initCompiler(Compiler *compiler,FunctionType type){
     compiler->function = NULL;
     compiler->type = type;
     compiler->function = newFunction();
+    compiler->locals = NULL;
     compiler->localCount = 0;
+    compiler->localCapacity = 0;
     compiler->scopeDepth = 0;
+    compiler->operandStart = 0;
+    compiler->operandConstants = 0;
+    compiler->operandCaches = 0;
+    compiler->lastCall = -1;
+    compiler->constants = NULL;
+    compiler->constantCapacity = 0;
+    compiler->constantCount = 0;
+    // the function is a root from here on, copying its name can collect
+    current = compiler;
     if(type != FUNC_MAIN){
-        compiler->function->name = copyString(parser.previous.start,parser.previous.length);
+        compiler->function->name = copyHashedString(parser.previous.start,parser.previous.length,parser.previous.hash);
     }
 
-    current = compiler;
-
-    Local*local = &current->locals[current->localCount++];
+    Local*local = pushLocal();
     local->depth = 0;
 
     if(type == FUNC_USER || type == FUNC_MAIN){
@@ -126,13 +358,28 @@ void initCompiler(Compiler *compiler,FunctionType type){
 ObjFunction* endCompiler(){
     emitReturn();
     ObjFunction*function = current->function;
-    #ifdef DEBUG_PRINT_EXECUTION
+    if(!parser.hadError){
+        optimizeChunk(currentChunk());
+        function->maxStack = maxStackSize(currentChunk(),function->arity);
+    }
+    if(vm.printCode){
         disAssembleChunk(currentChunk(),function->name == NULL?"main":function->name->chars);
-    #endif
+    }
+    FREE_ARRAY(ConstantEntry,current->constants,current->constantCapacity);
+    FREE_ARRAY(Local,current->locals,current->localCapacity);
     current = current->enclosing;
     return function;
 }
 
+void abandonCompilation(){
+    while(current != NULL){
+        FREE_ARRAY(ConstantEntry,current->constants,current->constantCapacity);
+        FREE_ARRAY(Local,current->locals,current->localCapacity);
+        current = current->enclosing;
+    }
+    currentClass = NULL;
+}
+
 void markCompilerRoots(){
     Compiler*compiler = current;
     while(compiler != NULL){
@@ -201,11 +448,17 @@ void parsePrecedence(Precedence precdence){
     }
 
     bool canAssign = precdence <= PREC_ASSIGNMENT;
+    int start = currentChunk()->size;
+    int constantCount = currentChunk()->constants.size;
+    int cacheCount = currentChunk()->cacheCount;
     prefixRule(canAssign);
 
     while(precdence <= getRule(parser.current.type)->precedence){
         advance();
         ParseFn infixRule = getRule(parser.previous.type)->infixRule;
+        current->operandStart = start;
+        current->operandConstants = constantCount;
+        current->operandCaches = cacheCount;
         infixRule(canAssign);
     }
     if(canAssign && match(TOKEN_EQUAL)){
@@ -232,7 +485,7 @@ void literal(bool canAssign){
 }
 
 static void string(bool canAssign){
-    emitConstant(OBJ_VAL(copyString(parser.previous.start + 1,parser.previous.length - 2)));
+    emitConstant(OBJ_VAL(copyHashedString(parser.previous.start + 1,parser.previous.length - 2,parser.previous.hash)));
 }
 
 void grouping(bool canAssign){
@@ -242,7 +495,25 @@ void grouping(bool canAssign){
 
 void unary(bool canAssign){
     TokenType operatorType = parser.previous.type;
+    int start = currentChunk()->size;
+    int constantCount = currentChunk()->constants.size;
+    int cacheCount = currentChunk()->cacheCount;
     expression();
+
+    Value value;
+    if(constantAt(start,&value)){
+        if(operatorType == TOKEN_BANG){
+            discardCode(start,constantCount,cacheCount);
+            emitValue(BOOL_VAL(isFalsey(value)));
+            return;
+        }
+        if(operatorType == TOKEN_MINUS && IS_NUM(value)){
+            discardCode(start,constantCount,cacheCount);
+            emitValue(NUM_VAL(-AS_NUM(value)));
+            return;
+        }
+    }
+
     switch(operatorType){
         case TOKEN_MINUS:
             emitByte(OP_NEGATE);
@@ -258,8 +529,20 @@ void unary(bool canAssign){
 void binary(bool canAssign){
     TokenType operatorType = parser.previous.type;
     ParseRule *rule = getRule(operatorType);
+    int leftStart = current->operandStart;
+    int leftConstants = current->operandConstants;
+    int leftCaches = current->operandCaches;
+    int rightStart = currentChunk()->size;
     parsePrecedence((Precedence)(rule->precedence + 1));
 
+    Value a,b,result;
+    if(constantBetween(leftStart,rightStart,&a) && constantAt(rightStart,&b)
+        && foldBinary(operatorType,a,b,&result)){
+        discardCode(leftStart,leftConstants,leftCaches);
+        emitValue(result);
+        return;
+    }
+
     switch(operatorType){
         case TOKEN_PLUS:
             emitByte(OP_ADD);
@@ -296,16 +579,55 @@ void binary(bool canAssign){
     }
 }
 
+// compiles an operand that can never run and throws its code away
+static void deadCode(Precedence precedence){
+    int start = currentChunk()->size;
+    int constantCount = currentChunk()->constants.size;
+    int cacheCount = currentChunk()->cacheCount;
+    parsePrecedence(precedence);
+    discardCode(start,constantCount,cacheCount);
+}
+
 void _and(bool canAssign){
-    int offset = emitJump(OP_JUMP_IF_FALSE);
+    int leftStart = current->operandStart;
+    int leftConstants = current->operandConstants;
+    int leftCaches = current->operandCaches;
+    Value left;
+    if(constantAt(leftStart,&left)){
+        if(isFalsey(left)){
+            deadCode(PREC_AND);
+        }
+        else{
+            discardCode(leftStart,leftConstants,leftCaches);
+            parsePrecedence(PREC_AND);
+        }
+        return;
+    }
+
+    int offset = emitJump(OP_JUMP_IF_FALSE_LONG);
     emitByte(OP_POP);
     parsePrecedence(PREC_AND);
     patchJump(offset);
 }
 
 void _or(bool canAssign){
-    int offset = emitJump(OP_JUMP_IF_FALSE);
-    int endOffset = emitJump(OP_JUMP);
+    int leftStart = current->operandStart;
+    int leftConstants = current->operandConstants;
+    int leftCaches = current->operandCaches;
+    Value left;
+    if(constantAt(leftStart,&left)){
+        if(isFalsey(left)){
+            discardCode(leftStart,leftConstants,leftCaches);
+            parsePrecedence(PREC_OR);
+        }
+        else{
+            deadCode(PREC_OR);
+        }
+        return;
+    }
+
+    int offset = emitJump(OP_JUMP_IF_FALSE_LONG);
+    int endOffset = emitJump(OP_JUMP_LONG);
     patchJump(offset);
     emitByte(OP_POP);
     parsePrecedence(PREC_OR);
@@ -314,8 +636,18 @@ void _or(bool canAssign){
 }
 
 
-uint8_t identifierConstant(Token *name){
-    return makeConstant(OBJ_VAL(copyString(name->start,name->length)));
+int identifierConstant(Token *name){
+    return makeConstant(OBJ_VAL(copyHashedString(name->start,name->length,name->hash)));
+}
+
+// returns the slot of the global variable, slots are shared by every chunk
+int globalVariable(Token *name){
+    int slot = globalSlot(copyHashedString(name->start,name->length,name->hash));
+    if(slot > MAX_INDEX){
+        errorAtPrevious("Too many global variables");
+        return 0;
+    }
+    return slot;
 }
 bool identifiersEqual(Token*a,Token*b){
     if(a->length != b->length)return false;
@@ -338,24 +670,28 @@ int resolveLocal(Compiler*compiler,Token *name){
 }
 
 void namedVariable(Token name,bool canAssign){
-    uint8_t getOp,setOp;
+    uint8_t getOp,setOp,getLongOp,setLongOp;
     int arg = resolveLocal(current,&name);
     if(arg != -1){
         getOp = OP_GET_LOCAL;
         setOp = OP_SET_LOCAL;
+        getLongOp = OP_GET_LOCAL_LONG;
+        setLongOp = OP_SET_LOCAL_LONG;
     }
     else{
-        arg = identifierConstant(&name);
+        arg = globalVariable(&name);
         getOp = OP_GET_GLOBAL;
         setOp = OP_SET_GLOBAL;
+        getLongOp = OP_GET_GLOBAL_LONG;
+        setLongOp = OP_SET_GLOBAL_LONG;
     }
 
     if(canAssign && match(TOKEN_EQUAL)){
         expression();
-        emitBytes(setOp,(uint8_t)arg);
+        emitIndexed(setOp,setLongOp,arg);
     }
     else{
-        emitBytes(getOp,(uint8_t)arg);
+        emitIndexed(getOp,getLongOp,arg);
     }
 }
 
@@ -377,19 +713,19 @@ uint8_t arguementList(){
 
 void dot(bool canAssign){
     consume(TOKEN_IDENTIFIER,"Expected field name");
-    uint8_t constantIdx = identifierConstant(&parser.previous);
+    int constantIdx = identifierConstant(&parser.previous);
 
     if(canAssign && match(TOKEN_EQUAL)){
         expression();
-        emitBytes(OP_SET_PROPERTY,constantIdx);
+        emitProperty(OP_SET_PROPERTY,OP_SET_PROPERTY_LONG,constantIdx,-1);
     }
     else if(match(TOKEN_LEFT_PAREN)){
         uint8_t argCount = arguementList();
-        emitBytes(OP_INVOKE,constantIdx);
-        emitByte(argCount);
+        current->lastCall = currentChunk()->size;
+        emitProperty(OP_INVOKE,OP_INVOKE_LONG,constantIdx,argCount);
     }
     else{
-        emitBytes(OP_GET_PROPERTY,constantIdx);
+        emitProperty(OP_GET_PROPERTY,OP_GET_PROPERTY_LONG,constantIdx,-1);
     }
 }
 
@@ -407,12 +743,12 @@ void _this(bool canAssign){
 
 void addLocal(Token name){
 
-    if(current->localCount == UINT8_MAX ){
+    if(current->localCount > MAX_INDEX){
         errorAtPrevious("Too Many local variables declared in a block");
         return;
     }
 
-    Local *local = &current->locals[current->localCount++];
+    Local *local = pushLocal();
     local->name = name;
     local->depth = -1;
 }
@@ -437,14 +773,14 @@ void declareVariable(){
     addLocal(*name);
 }
 
-uint8_t parseVariableName(const char*message){
+int parseVariableName(const char*message){
     consume(TOKEN_IDENTIFIER,message);
 
     declareVariable();
     if(current->scopeDepth > 0){
         return 0;
     }
-    return identifierConstant(&parser.previous);
+    return globalVariable(&parser.previous);
 }
 
 void markInitialised(){
@@ -452,22 +788,23 @@ void markInitialised(){
     current->locals[current->localCount - 1].depth = current->scopeDepth;
 }
 
-void defineVariable(uint8_t global){
+void defineVariable(int global){
     if(current->scopeDepth > 0){
         markInitialised();
         return;
     }
-    emitBytes(OP_DEFINE_GLOBAL,global);
+    emitIndexed(OP_DEFINE_GLOBAL,OP_DEFINE_GLOBAL_LONG,global);
 }
 
 
 void call(bool canAssign){
     uint8_t argCount = arguementList();
+    current->lastCall = currentChunk()->size;
     emitBytes(OP_CALL,argCount);
 }
 
 void varDeclaration(){
-    uint8_t global = parseVariableName("Expected Variable Name");
+    int global = parseVariableName("Expected Variable Name");
 
     if(match(TOKEN_EQUAL)){
         expression();
@@ -503,32 +840,62 @@ void beginScope(){
 }
 void endScope(){
     current->scopeDepth--;
-    uint8_t delCount = 0;
+    int delCount = 0;
     while(current->localCount > 0 && current->locals[current->localCount - 1].depth > current->scopeDepth){
         current->localCount--;
         delCount++;
     }
+    // OP_POPN pops at most UINT8_MAX values
+    while(delCount > UINT8_MAX){
+        emitBytes(OP_POPN,UINT8_MAX);
+        delCount -= UINT8_MAX;
+    }
     emitBytes(OP_POPN,delCount);
 }
 
 
+// compiles a statement that can never run and throws its code away
+static void deadStatement(){
+    int start = currentChunk()->size;
+    int constantCount = currentChunk()->constants.size;
+    int cacheCount = currentChunk()->cacheCount;
+    statement();
+    discardCode(start,constantCount,cacheCount);
+}
+
 void ifStatement(){
     consume(TOKEN_LEFT_PAREN,"Expected ( after if");
+    int conditionStart = currentChunk()->size;
+    int constantCount = currentChunk()->constants.size;
+    int cacheCount = currentChunk()->cacheCount;
     expression();
     consume(TOKEN_RIGHT_PAREN,"Expected ) after condition");
 
-    int thenOffset = emitJump(OP_JUMP_IF_FALSE);
+    Value condition;
+    if(constantAt(conditionStart,&condition)){
+        discardCode(conditionStart,constantCount,cacheCount);
+        bool taken = !isFalsey(condition);
+        if(taken)statement();
+        else deadStatement();
+        if(match(TOKEN_ELSE)){
+            if(taken)deadStatement();
+            else statement();
+        }
+        return;
+    }
+
+    int thenOffset = emitJump(OP_JUMP_IF_FALSE_LONG);
     
     emitByte(OP_POP);
 
     statement();
 
-    int elseOffset = emitJump(OP_JUMP);
-
-    emitByte(OP_POP);
+    int elseOffset = emitJump(OP_JUMP_LONG);
 
     patchJump(thenOffset);
 
+    emitByte(OP_POP);
+
     if(match(TOKEN_ELSE))statement();
 
     patchJump(elseOffset);
@@ -537,11 +904,25 @@ void ifStatement(){
 
 void whileStatement(){
     int loopStart = currentChunk()->size;
+    int constantCount = currentChunk()->constants.size;
+    int cacheCount = currentChunk()->cacheCount;
     consume(TOKEN_LEFT_PAREN,"Expect ( after while");
     expression();
     consume(TOKEN_RIGHT_PAREN,"Expect ) after condition");
 
-    int offset = emitJump(OP_JUMP_IF_FALSE);
+    Value condition;
+    if(constantAt(loopStart,&condition)){
+        discardCode(loopStart,constantCount,cacheCount);
+        if(isFalsey(condition)){
+            deadStatement();
+            return;
+        }
+        statement();
+        emitLoop(loopStart);
+        return;
+    }
+
+    int offset = emitJump(OP_JUMP_IF_FALSE_LONG);
     emitByte(OP_POP);
     statement();
     emitLoop(loopStart);
@@ -566,17 +947,28 @@ void forStatement(){
 
     int exitJump = -1;
     int loopStart = currentChunk()->size;
+    int conditionStart = loopStart;
+    bool neverRuns = false;
+    int constantCount = currentChunk()->constants.size;
+    int cacheCount = currentChunk()->cacheCount;
     if(!match(TOKEN_SEMICOLON)){
         // there is a condition
         expression();
         consume(TOKEN_SEMICOLON,"Expected ; after condition");
-        exitJump = emitJump(OP_JUMP_IF_FALSE);
-        emitByte(OP_POP);
+        Value condition;
+        if(constantAt(conditionStart,&condition)){
+            discardCode(conditionStart,constantCount,cacheCount);
+            neverRuns = isFalsey(condition);
+        }
+        else{
+            exitJump = emitJump(OP_JUMP_IF_FALSE_LONG);
+            emitByte(OP_POP);
+        }
     }
 
     if(!match(TOKEN_RIGHT_PAREN)){
         // there is an increment clause
-        int incrementJump = emitJump(OP_JUMP);
+        int incrementJump = emitJump(OP_JUMP_LONG);
         int incrementStart = currentChunk()->size;
 
         expression();
@@ -589,7 +981,10 @@ void forStatement(){
     }
     statement();
     emitLoop(loopStart);
-    
+
+    if(neverRuns){
+        discardCode(conditionStart,constantCount,cacheCount);
+    }
     if(exitJump != -1){
         patchJump(exitJump);
         emitByte(OP_POP);
@@ -611,7 +1006,7 @@ void function(FunctionType type){
             if(current->function->arity == 255){
                 errorAtCurrent("Too Many arguments");
             }
-            uint8_t global = parseVariableName("Expected variable name");
+            int global = parseVariableName("Expected variable name");
             defineVariable(global);
 
         }while(match(TOKEN_COMMA));
@@ -625,12 +1020,25 @@ void function(FunctionType type){
 }
 
 void funcDeclaration(){
-    uint8_t global = parseVariableName("Expected a function name");
+    int global = parseVariableName("Expected a function name");
     markInitialised();
     function(FUNC_USER);
     defineVariable(global);
 }
 
+// turns the call that ends the code emitted so far into a tail call, its result is what gets returned
+static void emitTailCall(){
+    Chunk*chunk = currentChunk();
+    int offset = current->lastCall;
+    if(offset == -1 || offset + instructionLength(chunk->code[offset]) != chunk->size)return;
+    switch(chunk->code[offset]){
+        case OP_CALL: chunk->code[offset] = OP_TAIL_CALL; break;
+        case OP_INVOKE: chunk->code[offset] = OP_TAIL_INVOKE; break;
+        case OP_INVOKE_LONG: chunk->code[offset] = OP_TAIL_INVOKE_LONG; break;
+        default: break;
+    }
+}
+
 void returnStatement(){
     if(current->type == FUNC_MAIN){
         errorAtPrevious("Can't return from main");
@@ -640,6 +1048,7 @@ void returnStatement(){
             errorAtPrevious("Can't return anything for init method of class");
         }
         expression();
+        emitTailCall();
         emitByte(OP_RETURN);
     }
     else{
@@ -650,23 +1059,24 @@ void returnStatement(){
 
 void method(){
     consume(TOKEN_IDENTIFIER,"Expected method name");
-    uint8_t name = identifierConstant(&parser.previous);
+    int name = identifierConstant(&parser.previous);
     FunctionType type = FUNC_METHOD;
     if(parser.previous.length == 4 && memcmp(parser.previous.start,"init",4) == 0){
         type = FUNC_INITIALIZER;
     }
     function(type);
-    emitBytes(OP_METHOD,name);
+    emitIndexed(OP_METHOD,OP_METHOD_LONG,name);
 }
 
 void classDeclaration(){
     consume(TOKEN_IDENTIFIER,"Expected class name after class keyword");
 
-    uint8_t constantIdx = identifierConstant(&parser.previous);
+    int constantIdx = identifierConstant(&parser.previous);
+    int global = current->scopeDepth > 0?0:globalVariable(&parser.previous);
     declareVariable();
 
-    emitBytes(OP_CLASS,constantIdx);
-    defineVariable(constantIdx);
+    emitIndexed(OP_CLASS,OP_CLASS_LONG,constantIdx);
+    defineVariable(global);
 
     ClassCompiler classCompiler;
     classCompiler.enclosing = currentClass;
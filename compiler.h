@@ -36,13 +36,27 @@ typedef enum{
     FUNC_INITIALIZER,
 }FunctionType;
 
+// entry of the table the compiler looks constants up in so each value is added to a chunk only once
+typedef struct{
+    Value value;
+    int index; // -1 for an empty entry
+}ConstantEntry;
+
 typedef struct Compiler{
     struct Compiler *enclosing; // compiler which called this compiler
     ObjFunction*function; // current function which it is compiling
     FunctionType type; // type of function 
-    Local locals[UINT8_MAX + 1]; // array of local variables
+    Local*locals; // array of local variables, grows as they are declared
     int localCount;
+    int localCapacity;
     int scopeDepth;
+    int operandStart; // offset where the left operand of the infix operator being compiled starts
+    int operandConstants; // number of constants the chunk had when that operand started
+    int operandCaches; // number of inline caches the chunk had when that operand started
+    int lastCall; // offset of the last OP_CALL or OP_INVOKE emitted, -1 if there is none
+    ConstantEntry*constants; // open addressing table of the constants already in the chunk
+    int constantCapacity;
+    int constantCount;
 }Compiler;
 
 typedef struct ClassCompiler{
@@ -62,5 +76,7 @@ ParseRule* getRule(TokenType type);
 ObjFunction* compile(const char*source);
 
 void markCompilerRoots();
+// frees what the compilers left open by an error unwinding out of compile() own
+void abandonCompilation();
 
 #endif
\ No newline at end of file
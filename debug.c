@@ -1,8 +1,131 @@
 #include "debug.h"
 #include "value.h"
+#include "vm.h"
 #include <stdio.h>
+#include <strings.h>
 
 
+// names of the opcodes, indexed by OpCode
+static const char* opcodeNames[] = {
+    [OP_RETURN] = "OP_RETURN",
+    [OP_CONSTANT] = "OP_CONSTANT",
+    [OP_NEGATE] = "OP_NEGATE",
+    [OP_ADD] = "OP_ADD",
+    [OP_SUB] = "OP_SUB",
+    [OP_MUL] = "OP_MUL",
+    [OP_DIV] = "OP_DIV",
+    [OP_NOT] = "OP_NOT",
+    [OP_FALSE] = "OP_FALSE",
+    [OP_TRUE] = "OP_TRUE",
+    [OP_NIL] = "OP_NIL",
+    [OP_EQUAL] = "OP_EQUAL",
+    [OP_GREATER] = "OP_GREATER",
+    [OP_LESSER] = "OP_LESSER",
+    [OP_PRINT] = "OP_PRINT",
+    [OP_POP] = "OP_POP",
+    [OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+    [OP_GET_GLOBAL] = "OP_GET_GLOBAL",
+    [OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+    [OP_SET_LOCAL] = "OP_SET_LOCAL",
+    [OP_GET_LOCAL] = "OP_GET_LOCAL",
+    [OP_POPN] = "OP_POPN",
+    [OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+    [OP_JUMP] = "OP_JUMP",
+    [OP_LOOP] = "OP_LOOP",
+    [OP_CALL] = "OP_CALL",
+    [OP_CLASS] = "OP_CLASS",
+    [OP_SET_PROPERTY] = "OP_SET_PROPERTY",
+    [OP_GET_PROPERTY] = "OP_GET_PROPERTY",
+    [OP_METHOD] = "OP_METHOD",
+    [OP_INVOKE] = "OP_INVOKE",
+    [OP_NOT_EQUAL] = "OP_NOT_EQUAL",
+    [OP_LESS_EQUAL] = "OP_LESS_EQUAL",
+    [OP_GREATER_EQUAL] = "OP_GREATER_EQUAL",
+    [OP_POP_JUMP_IF_FALSE] = "OP_POP_JUMP_IF_FALSE",
+    [OP_JUMP_IF_NOT_LESS] = "OP_JUMP_IF_NOT_LESS",
+    [OP_JUMP_IF_NOT_LESS_EQUAL] = "OP_JUMP_IF_NOT_LESS_EQUAL",
+    [OP_JUMP_IF_NOT_GREATER] = "OP_JUMP_IF_NOT_GREATER",
+    [OP_JUMP_IF_NOT_GREATER_EQUAL] = "OP_JUMP_IF_NOT_GREATER_EQUAL",
+    [OP_JUMP_IF_NOT_EQUAL] = "OP_JUMP_IF_NOT_EQUAL",
+    [OP_JUMP_IF_EQUAL] = "OP_JUMP_IF_EQUAL",
+    [OP_ADD_LOCAL_CONST] = "OP_ADD_LOCAL_CONST",
+    [OP_ADD_NUM] = "OP_ADD_NUM",
+    [OP_ADD_STR] = "OP_ADD_STR",
+    [OP_CONSTANT_LONG] = "OP_CONSTANT_LONG",
+    [OP_DEFINE_GLOBAL_LONG] = "OP_DEFINE_GLOBAL_LONG",
+    [OP_GET_GLOBAL_LONG] = "OP_GET_GLOBAL_LONG",
+    [OP_SET_GLOBAL_LONG] = "OP_SET_GLOBAL_LONG",
+    [OP_CLASS_LONG] = "OP_CLASS_LONG",
+    [OP_METHOD_LONG] = "OP_METHOD_LONG",
+    [OP_SET_PROPERTY_LONG] = "OP_SET_PROPERTY_LONG",
+    [OP_GET_PROPERTY_LONG] = "OP_GET_PROPERTY_LONG",
+    [OP_INVOKE_LONG] = "OP_INVOKE_LONG",
+    [OP_JUMP_LONG] = "OP_JUMP_LONG",
+    [OP_JUMP_IF_FALSE_LONG] = "OP_JUMP_IF_FALSE_LONG",
+    [OP_LOOP_LONG] = "OP_LOOP_LONG",
+    [OP_GET_LOCAL_LONG] = "OP_GET_LOCAL_LONG",
+    [OP_SET_LOCAL_LONG] = "OP_SET_LOCAL_LONG",
+    [OP_TAIL_CALL] = "OP_TAIL_CALL",
+    [OP_TAIL_INVOKE] = "OP_TAIL_INVOKE",
+    [OP_TAIL_INVOKE_LONG] = "OP_TAIL_INVOKE_LONG",
+};
+
+// accepts the name with or without the OP_ prefix, in any case
+int findOpcode(const char*name){
+    if(strncasecmp(name,"OP_",3) == 0)name += 3;
+    for(int i = 0;i < (int)(sizeof(opcodeNames) / sizeof(opcodeNames[0]));i++){
+        if(opcodeNames[i] != NULL && strcasecmp(opcodeNames[i] + 3,name) == 0){
+            return i;
+        }
+    }
+    return -1;
+}
+
+// an opcode the compiler, optimizer.c or run() puts in place of the instructions it stands for
+typedef struct{
+    uint8_t opcode;
+    int partCount;
+    uint8_t parts[6];
+}DerivedOpcode;
+
+static const DerivedOpcode derivedOpcodes[] = {
+    // quickened by run()
+    {OP_ADD_NUM,1,{OP_ADD}},
+    {OP_ADD_STR,1,{OP_ADD}},
+    // fused by optimizer.c
+    {OP_ADD_LOCAL_CONST,5,{OP_GET_LOCAL,OP_CONSTANT,OP_ADD,OP_SET_LOCAL,OP_POP}},
+    {OP_NOT_EQUAL,2,{OP_EQUAL,OP_NOT}},
+    {OP_LESS_EQUAL,2,{OP_GREATER,OP_NOT}},
+    {OP_GREATER_EQUAL,2,{OP_LESSER,OP_NOT}},
+    {OP_POP_JUMP_IF_FALSE,3,{OP_JUMP_IF_FALSE,OP_JUMP_IF_FALSE_LONG,OP_POP}},
+    {OP_JUMP_IF_NOT_LESS,4,{OP_LESSER,OP_JUMP_IF_FALSE,OP_JUMP_IF_FALSE_LONG,OP_POP}},
+    {OP_JUMP_IF_NOT_LESS_EQUAL,5,{OP_GREATER,OP_NOT,OP_JUMP_IF_FALSE,OP_JUMP_IF_FALSE_LONG,OP_POP}},
+    {OP_JUMP_IF_NOT_GREATER,4,{OP_GREATER,OP_JUMP_IF_FALSE,OP_JUMP_IF_FALSE_LONG,OP_POP}},
+    {OP_JUMP_IF_NOT_GREATER_EQUAL,5,{OP_LESSER,OP_NOT,OP_JUMP_IF_FALSE,OP_JUMP_IF_FALSE_LONG,OP_POP}},
+    {OP_JUMP_IF_NOT_EQUAL,4,{OP_EQUAL,OP_JUMP_IF_FALSE,OP_JUMP_IF_FALSE_LONG,OP_POP}},
+    {OP_JUMP_IF_EQUAL,5,{OP_EQUAL,OP_NOT,OP_JUMP_IF_FALSE,OP_JUMP_IF_FALSE_LONG,OP_POP}},
+    // forward jumps are emitted long and shortened by optimizer.c
+    {OP_JUMP,1,{OP_JUMP_LONG}},
+    {OP_JUMP_IF_FALSE,1,{OP_JUMP_IF_FALSE_LONG}},
+    {OP_LOOP,1,{OP_LOOP_LONG}},
+    {OP_JUMP_LONG,1,{OP_JUMP}},
+    {OP_JUMP_IF_FALSE_LONG,1,{OP_JUMP_IF_FALSE}},
+    {OP_LOOP_LONG,1,{OP_LOOP}},
+    // calls right before a return, rewritten by the compiler
+    {OP_TAIL_CALL,1,{OP_CALL}},
+    {OP_TAIL_INVOKE,1,{OP_INVOKE}},
+    {OP_TAIL_INVOKE_LONG,1,{OP_INVOKE_LONG}},
+};
+
+void addDerivedOpcodes(bool*ops){
+    for(int i = 0;i < (int)(sizeof(derivedOpcodes) / sizeof(derivedOpcodes[0]));i++){
+        const DerivedOpcode*derived = &derivedOpcodes[i];
+        for(int j = 0;j < derived->partCount;j++){
+            if(ops[derived->parts[j]])ops[derived->opcode] = true;
+        }
+    }
+}
+
 void disAssembleChunk(Chunk *chunk,const char *name){
     printf("===%s===\n",name);
 
@@ -12,6 +135,42 @@ void disAssembleChunk(Chunk *chunk,const char *name){
 }
 
 
+// number of bytes taken by the index or offset following the opcode, 3 for the _LONG variants
+static int operandWidth(uint8_t opcode){
+    switch(opcode){
+        case OP_CONSTANT_LONG:
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_GET_GLOBAL_LONG:
+        case OP_SET_GLOBAL_LONG:
+        case OP_CLASS_LONG:
+        case OP_METHOD_LONG:
+        case OP_SET_PROPERTY_LONG:
+        case OP_GET_PROPERTY_LONG:
+        case OP_INVOKE_LONG:
+        case OP_GET_LOCAL_LONG:
+        case OP_SET_LOCAL_LONG:
+        case OP_TAIL_INVOKE_LONG:
+        case OP_JUMP_LONG:
+        case OP_JUMP_IF_FALSE_LONG:
+        case OP_LOOP_LONG:
+            return 3;
+        default:
+            return 1;
+    }
+}
+
+// reads the index following the opcode at offset, 8 or 24 bits wide
+static int readIndex(Chunk *chunk,int offset){
+    uint8_t *code = &chunk->code[offset];
+    return operandWidth(code[0]) == 3?code[1] << 16 | code[2] << 8 | code[3]:code[1];
+}
+
+// reads the cache index at offset, 16 bits wide or 24 after the name of a _LONG variant
+static int readCache(Chunk *chunk,int offset,int width){
+    uint8_t *code = &chunk->code[offset];
+    return width == 3?code[0] << 16 | code[1] << 8 | code[2]:code[0] << 8 | code[1];
+}
+
 // for OPCODE
 int simpleInstruction(const char *name,int offset){
     printf("%s\n",name);
@@ -21,33 +180,65 @@ int simpleInstruction(const char *name,int offset){
 // for OPCODE INDEX
 int constantInstruction(const char *name,Chunk *chunk,int offset){
 
-    int constant = chunk->code[offset + 1];
+    int constant = readIndex(chunk,offset);
     printf("%s %d ",name,constant);
     Value value = chunk->constants.values[constant];
     printValue(value);
     printf("\n");
-    return offset + 2;
+    return offset + 1 + operandWidth(chunk->code[offset]);
+}
+
+// for OPCODE SLOT of a global variable
+int globalInstruction(const char *name,Chunk *chunk,int offset){
+    int slot = readIndex(chunk,offset);
+    printf("%s %d ",name,slot);
+    printValue(vm.globalNames.values[slot]);
+    printf("\n");
+    return offset + 1 + operandWidth(chunk->code[offset]);
 }
 
 int byteInstruction(const char *name,Chunk *chunk,int offset){
-    int slot = chunk->code[offset + 1];
+    int slot = readIndex(chunk,offset);
     printf("%s %d\n",name,slot);
-    return offset + 2;
+    return offset + 1 + operandWidth(chunk->code[offset]);
 }
 
 int jumpInstruction(const char*name,int sign,Chunk*chunk,int offset){
-    uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
-    jump |= (chunk->code[offset + 2]);
-    printf("%s %4d -> %d\n",name,offset,offset + 3 + sign*jump);
-    return offset + 3;
+    int length = instructionLength(chunk->code[offset]);
+    int jump = length == 4?readIndex(chunk,offset):chunk->code[offset + 1] << 8 | chunk->code[offset + 2];
+    printf("%s %4d -> %d\n",name,offset,offset + length + sign*jump);
+    return offset + length;
 }
 
 int invokeInstruction(const char*name,Chunk *chunk,int offset){
-    uint8_t constant = chunk->code[offset + 1];
-    uint8_t argCount = chunk->code[offset + 2];
+    int constant = readIndex(chunk,offset);
+    int width = operandWidth(chunk->code[offset]);
+    uint8_t argCount = chunk->code[offset + 1 + width];
+    int cache = readCache(chunk,offset + 2 + width,width);
     printf("%s (%d args) %d '", name, argCount, constant);
     printValue(chunk->constants.values[constant]);
-    printf("'\n");
+    printf("' cache %d\n",cache);
+    return offset + instructionLength(chunk->code[offset]);
+}
+
+// for OPCODE INDEX CACHE
+int propertyInstruction(const char*name,Chunk *chunk,int offset){
+    int constant = readIndex(chunk,offset);
+    int width = operandWidth(chunk->code[offset]);
+    int cache = readCache(chunk,offset + 1 + width,width);
+    printf("%s %d ",name,constant);
+    printValue(chunk->constants.values[constant]);
+    printf(" cache %d\n",cache);
+    return offset + instructionLength(chunk->code[offset]);
+}
+
+// for OPCODE SLOT INDEX
+int localConstantInstruction(const char*name,Chunk *chunk,int offset){
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 2];
+    printf("%s %d %d ",name,slot,constant);
+    printValue(chunk->constants.values[constant]);
+    printf("\n");
     return offset + 3;
 }
 
@@ -96,11 +287,11 @@ int disAssembleInstruction(Chunk * chunk,int offset){
         case OP_POP:
             return simpleInstruction("OP_POP",offset);
         case OP_DEFINE_GLOBAL:
-            return constantInstruction("OP_DEFINE_GLOBAL",chunk,offset);
+            return globalInstruction("OP_DEFINE_GLOBAL",chunk,offset);
         case OP_GET_GLOBAL:
-            return constantInstruction("OP_GET_GLOBAL",chunk,offset);
+            return globalInstruction("OP_GET_GLOBAL",chunk,offset);
         case OP_SET_GLOBAL:
-            return constantInstruction("OP_SET_GLOBAL",chunk,offset);
+            return globalInstruction("OP_SET_GLOBAL",chunk,offset);
         case OP_SET_LOCAL:
             return byteInstruction("OP_SET_LOCAL",chunk,offset);
         case OP_GET_LOCAL:
@@ -118,13 +309,73 @@ int disAssembleInstruction(Chunk * chunk,int offset){
         case OP_CLASS:
             return constantInstruction("OP_CLASS",chunk,offset);
         case OP_SET_PROPERTY:
-            return constantInstruction("OP_SET_PROPERTY",chunk,offset);
+            return propertyInstruction("OP_SET_PROPERTY",chunk,offset);
         case OP_GET_PROPERTY:
-            return constantInstruction("OP_GET_PROPERTY",chunk,offset);
+            return propertyInstruction("OP_GET_PROPERTY",chunk,offset);
         case OP_METHOD:
             return constantInstruction("OP_METHOD",chunk,offset);
         case OP_INVOKE:
             return invokeInstruction("OP_INVOKE", chunk, offset);
+        case OP_NOT_EQUAL:
+            return simpleInstruction("OP_NOT_EQUAL",offset);
+        case OP_LESS_EQUAL:
+            return simpleInstruction("OP_LESS_EQUAL",offset);
+        case OP_GREATER_EQUAL:
+            return simpleInstruction("OP_GREATER_EQUAL",offset);
+        case OP_POP_JUMP_IF_FALSE:
+            return jumpInstruction("OP_POP_JUMP_IF_FALSE",1,chunk,offset);
+        case OP_JUMP_IF_NOT_LESS:
+            return jumpInstruction("OP_JUMP_IF_NOT_LESS",1,chunk,offset);
+        case OP_JUMP_IF_NOT_LESS_EQUAL:
+            return jumpInstruction("OP_JUMP_IF_NOT_LESS_EQUAL",1,chunk,offset);
+        case OP_JUMP_IF_NOT_GREATER:
+            return jumpInstruction("OP_JUMP_IF_NOT_GREATER",1,chunk,offset);
+        case OP_JUMP_IF_NOT_GREATER_EQUAL:
+            return jumpInstruction("OP_JUMP_IF_NOT_GREATER_EQUAL",1,chunk,offset);
+        case OP_JUMP_IF_NOT_EQUAL:
+            return jumpInstruction("OP_JUMP_IF_NOT_EQUAL",1,chunk,offset);
+        case OP_JUMP_IF_EQUAL:
+            return jumpInstruction("OP_JUMP_IF_EQUAL",1,chunk,offset);
+        case OP_ADD_LOCAL_CONST:
+            return localConstantInstruction("OP_ADD_LOCAL_CONST",chunk,offset);
+        case OP_ADD_NUM:
+            return simpleInstruction("OP_ADD_NUM",offset);
+        case OP_ADD_STR:
+            return simpleInstruction("OP_ADD_STR",offset);
+        case OP_CONSTANT_LONG:
+            return constantInstruction("OP_CONSTANT_LONG",chunk,offset);
+        case OP_DEFINE_GLOBAL_LONG:
+            return globalInstruction("OP_DEFINE_GLOBAL_LONG",chunk,offset);
+        case OP_GET_GLOBAL_LONG:
+            return globalInstruction("OP_GET_GLOBAL_LONG",chunk,offset);
+        case OP_SET_GLOBAL_LONG:
+            return globalInstruction("OP_SET_GLOBAL_LONG",chunk,offset);
+        case OP_CLASS_LONG:
+            return constantInstruction("OP_CLASS_LONG",chunk,offset);
+        case OP_METHOD_LONG:
+            return constantInstruction("OP_METHOD_LONG",chunk,offset);
+        case OP_SET_PROPERTY_LONG:
+            return propertyInstruction("OP_SET_PROPERTY_LONG",chunk,offset);
+        case OP_GET_PROPERTY_LONG:
+            return propertyInstruction("OP_GET_PROPERTY_LONG",chunk,offset);
+        case OP_INVOKE_LONG:
+            return invokeInstruction("OP_INVOKE_LONG",chunk,offset);
+        case OP_JUMP_LONG:
+            return jumpInstruction("OP_JUMP_LONG",1,chunk,offset);
+        case OP_JUMP_IF_FALSE_LONG:
+            return jumpInstruction("OP_JUMP_IF_FALSE_LONG",1,chunk,offset);
+        case OP_LOOP_LONG:
+            return jumpInstruction("OP_LOOP_LONG",-1,chunk,offset);
+        case OP_GET_LOCAL_LONG:
+            return byteInstruction("OP_GET_LOCAL_LONG",chunk,offset);
+        case OP_SET_LOCAL_LONG:
+            return byteInstruction("OP_SET_LOCAL_LONG",chunk,offset);
+        case OP_TAIL_CALL:
+            return byteInstruction("OP_TAIL_CALL",chunk,offset);
+        case OP_TAIL_INVOKE:
+            return invokeInstruction("OP_TAIL_INVOKE",chunk,offset);
+        case OP_TAIL_INVOKE_LONG:
+            return invokeInstruction("OP_TAIL_INVOKE_LONG",chunk,offset);
         default:
             printf("Unknown opcode %d\n",instruction);
             return offset + 1;
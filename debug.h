@@ -8,4 +8,12 @@
 void disAssembleChunk(Chunk *chunk,const char *name);
 int disAssembleInstruction(Chunk *chunk,int offset);
 
+// returns the opcode with the given name or -1 if there is no such opcode
+int findOpcode(const char*name);
+/*
+    marks in ops, which has an entry for each opcode, the opcodes that can stand for a marked one once the code
+    was fused, quickened or had its jumps shortened, so a trace filtered on source level opcodes still sees them
+*/
+void addDerivedOpcodes(bool*ops);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,71 @@
+#ifndef hash_h
+#define hash_h
+
+#include "common.h"
+#include <string.h>
+
+/*
+    string hash in the style of wyhash: the key is read 8 bytes at a time and folded in with 64x64->128 bit
+    multiplications, which spread every input bit over the low bits findEntry() masks with. Lives in a header
+    so the scanner can hash identifiers without depending on the object module.
+*/
+
+#define HASH_P0 0xa0761d6478bd642full
+#define HASH_P1 0xe7037ed1a0b428dbull
+#define HASH_P2 0x8ebc6af09c88c6e3ull
+
+// multiplies a and b and folds the high half of the product into the low one
+static inline uint64_t hashMix(uint64_t a,uint64_t b){
+    __uint128_t product = (__uint128_t)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+static inline uint64_t hashRead8(const char*p){
+    uint64_t word;
+    memcpy(&word,p,8);
+    return word;
+}
+
+static inline uint64_t hashRead4(const char*p){
+    uint32_t word;
+    memcpy(&word,p,4);
+    return word;
+}
+
+static inline uint32_t hashString(const char*key,int length){
+    uint64_t seed = HASH_P0 ^ (uint64_t)length;
+    uint64_t a,b;
+    if(length <= 16){
+        if(length >= 4){
+            // two overlapping pairs of 4 byte reads cover any length from 4 to 16
+            int middle = (length >> 3) << 2;
+            a = (hashRead4(key) << 32) | hashRead4(key + middle);
+            b = (hashRead4(key + length - 4) << 32) | hashRead4(key + length - 4 - middle);
+        }
+        else if(length > 0){
+            a = ((uint64_t)(uint8_t)key[0] << 16) | ((uint64_t)(uint8_t)key[length >> 1] << 8)
+                | (uint8_t)key[length - 1];
+            b = 0;
+        }
+        else{
+            a = 0;
+            b = 0;
+        }
+    }
+    else{
+        const char*p = key;
+        int left = length;
+        while(left > 16){
+            seed = hashMix(hashRead8(p) ^ HASH_P1,hashRead8(p + 8) ^ seed);
+            p += 16;
+            left -= 16;
+        }
+        // the last 16 bytes, overlapping the ones already mixed in when the length isn't a multiple of 16
+        a = hashRead8(p + left - 16);
+        b = hashRead8(p + left - 8);
+    }
+    uint64_t hash = hashMix(hashMix(a ^ HASH_P1,b ^ seed) ^ HASH_P2,(uint64_t)length ^ HASH_P1);
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+#endif
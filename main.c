@@ -2,6 +2,7 @@
 #include "chunk.h"
 #include "debug.h"
 #include "vm.h"
+#include "memory.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -77,23 +78,196 @@ void runFile(const char *path){
 }
 
 
+// returns true if the environment variable is set to anything but "" or "0"
+bool envFlag(const char*name){
+    const char*value = getenv(name);
+    return value != NULL && value[0] != '\0' && strcmp(value,"0") != 0;
+}
+
+// restricts the trace to the opcodes in a comma separated list like "OP_ADD,call"
+bool setTraceOps(const char*list){
+    char names[REPL_LINE_SIZE];
+    snprintf(names,sizeof(names),"%s",list);
+    for(char*name = strtok(names,",");name != NULL;name = strtok(NULL,",")){
+        int opcode = findOpcode(name);
+        if(opcode == -1){
+            fprintf(stderr,"Unknown opcode %s\n",name);
+            return false;
+        }
+        vm.traceOps[opcode] = true;
+    }
+    addDerivedOpcodes(vm.traceOps);
+    vm.traceOpsOnly = true;
+    vm.traceExecution = true;
+    return true;
+}
+
+bool parseOption(const char*arg);
+
+// applies the flag --<flag>=<value of the variable> if the environment variable is set
+bool envOption(const char*name,const char*flag){
+    const char*value = getenv(name);
+    if(value == NULL)return true;
+    char option[REPL_LINE_SIZE];
+    snprintf(option,sizeof(option),"--%s=%s",flag,value);
+    if(parseOption(option))return true;
+    fprintf(stderr,"Invalid value for %s\n",name);
+    return false;
+}
+
+// reads the debugging options from the environment, command line flags are applied after these
+bool readEnvOptions(){
+    if(envFlag("CLOX_TRACE"))vm.traceExecution = true;
+    if(envFlag("CLOX_PRINT_CODE"))vm.printCode = true;
+    const char*ops = getenv("CLOX_TRACE_OPS");
+    if(ops != NULL && !setTraceOps(ops))return false;
+    const char*function = getenv("CLOX_TRACE_FN");
+    if(function != NULL){
+        vm.traceFunction = function;
+        vm.traceExecution = true;
+    }
+    if(envFlag("CLOX_GC_LOG"))vm.gcLog = true;
+    return envOption("CLOX_GC_INITIAL_HEAP","gc-initial-heap") && envOption("CLOX_GC_GROWTH","gc-growth")
+        && envOption("CLOX_GC_MAX_HEAP","gc-max-heap") && envOption("CLOX_GC_MIN_INTERVAL","gc-min-interval");
+}
+
+// reads a byte count with an optional K, M or G suffix, returns false if it isn't one
+bool parseSize(const char*text,size_t*size){
+    char*end;
+    unsigned long long value = strtoull(text,&end,10);
+    if(end == text || text[0] == '-')return false;
+    int shift = 0;
+    if(*end == 'K' || *end == 'k')shift = 10;
+    else if(*end == 'M' || *end == 'm')shift = 20;
+    else if(*end == 'G' || *end == 'g')shift = 30;
+    if(shift != 0)end++;
+    if(*end != '\0' || value > (SIZE_MAX >> shift))return false;
+    *size = (size_t)value << shift;
+    return true;
+}
+
+// applies a single command line flag, returns false if the flag is invalid
+bool parseOption(const char*arg){
+    if(strcmp(arg,"--trace") == 0){
+        vm.traceExecution = true;
+    }
+    else if(strncmp(arg,"--trace-op=",11) == 0){
+        return setTraceOps(arg + 11);
+    }
+    else if(strncmp(arg,"--trace-fn=",11) == 0){
+        vm.traceFunction = arg + 11;
+        vm.traceExecution = true;
+    }
+    else if(strcmp(arg,"--print-code") == 0){
+        vm.printCode = true;
+    }
+    else if(strncmp(arg,"--max-frames=",13) == 0){
+        char*end;
+        long frames = strtol(arg + 13,&end,10);
+        if(*end != '\0' || frames < 1 || frames > INT32_MAX)return false;
+        vm.maxFrames = (int)frames;
+    }
+    else if(strcmp(arg,"--gc-concurrent") == 0){
+        // the marker thread reads values the mutator is storing, which is only safe when they are one word
+        #ifdef NAN_BOXING
+        vm.gcConcurrent = true;
+        #else
+        fprintf(stderr,"--gc-concurrent needs a build with NAN_BOXING\n");
+        return false;
+        #endif
+    }
+    else if(strcmp(arg,"--gc-compact") == 0){
+        vm.gcCompact = true;
+    }
+    else if(strncmp(arg,"--gc-sweep-threads=",19) == 0){
+        char*end;
+        long threads = strtol(arg + 19,&end,10);
+        if(*end != '\0' || arg[19] == '\0' || threads < 0 || threads > GC_SWEEP_THREADS_MAX)return false;
+        vm.gcSweepThreads = (int)threads;
+    }
+    else if(strncmp(arg,"--gc-pause=",11) == 0){
+        char*end;
+        long pause = strtol(arg + 11,&end,10);
+        if(*end != '\0' || arg[11] == '\0' || pause < 0)return false;
+        vm.gcPause = pause;
+    }
+    else if(strncmp(arg,"--gc-initial-heap=",18) == 0){
+        return parseSize(arg + 18,&vm.nextGC);
+    }
+    else if(strncmp(arg,"--gc-growth=",12) == 0){
+        char*end;
+        double growth = strtod(arg + 12,&end);
+        // a heap allowed to grow by nothing would be collected on every allocation
+        if(*end != '\0' || arg[12] == '\0' || !(growth > 1))return false;
+        vm.gcGrowth = growth;
+    }
+    else if(strncmp(arg,"--gc-max-heap=",14) == 0){
+        return parseSize(arg + 14,&vm.gcMaxHeap);
+    }
+    else if(strncmp(arg,"--gc-min-interval=",18) == 0){
+        return parseSize(arg + 18,&vm.gcMinInterval);
+    }
+    else if(strcmp(arg,"--gc-log") == 0){
+        vm.gcLog = true;
+    }
+    else{
+        return false;
+    }
+    return true;
+}
+
+void usage(){
+    fprintf(stderr,"Usage : clox [options] [path]\n");
+    fprintf(stderr,"  --trace             print the stack and each instruction as it executes (CLOX_TRACE)\n");
+    fprintf(stderr,"  --trace-op=OPS      only trace the comma separated opcodes (CLOX_TRACE_OPS), along with the\n");
+    fprintf(stderr,"                      fused, quickened and tail call opcodes that stand for them\n");
+    fprintf(stderr,"  --trace-fn=NAME     only trace inside functions called NAME (CLOX_TRACE_FN)\n");
+    fprintf(stderr,"  --print-code        disassemble each function after compiling it (CLOX_PRINT_CODE)\n");
+    fprintf(stderr,"  --max-frames=N      calls nested deeper than N are a stack overflow (default %d)\n",FRAME_MAX);
+    fprintf(stderr,"  --gc-concurrent     mark on a helper thread while the program runs\n");
+    fprintf(stderr,"  --gc-compact        move objects out of sparse heap pages after a collection\n");
+    fprintf(stderr,"  --gc-sweep-threads=N free garbage on N helper threads, at most %d (default 0)\n",GC_SWEEP_THREADS_MAX);
+    fprintf(stderr,"  --gc-pause=US       longest pause of a collection slice in microseconds, 0 marks all at once (default %d)\n",GC_PAUSE_DEFAULT);
+    fprintf(stderr,"  --gc-initial-heap=SIZE heap size that starts the first collection, K, M or G suffix (default 1M, CLOX_GC_INITIAL_HEAP)\n");
+    fprintf(stderr,"  --gc-growth=F       the next collection starts once the heap grew F times (default %d, CLOX_GC_GROWTH)\n",GC_GROW_RATE);
+    fprintf(stderr,"  --gc-max-heap=SIZE  allocating past SIZE is an out of memory error, 0 for no limit (CLOX_GC_MAX_HEAP)\n");
+    fprintf(stderr,"  --gc-min-interval=SIZE allocate at least SIZE bytes between two collections (default 0, CLOX_GC_MIN_INTERVAL)\n");
+    fprintf(stderr,"  --gc-log            print a line to stderr for each collection (CLOX_GC_LOG)\n");
+}
+
+
 int main(int argc, char **argv){
 
 
     // initialise the VM
     initVM();
 
-    // repl if no arguement
-    if(argc == 1){
-        repl();
-    }
-    // runs source file if 1 arguement is specfied
-    else if(argc == 2){
-        runFile(argv[1]);
+    // options come from the environment first and then from the flags
+    const char*path = NULL;
+    bool valid = readEnvOptions();
+    for(int i = 1;valid && i < argc;i++){
+        if(strncmp(argv[i],"--",2) == 0){
+            valid = parseOption(argv[i]);
+        }
+        else if(path == NULL){
+            path = argv[i];
+        }
+        else{
+            valid = false;
+        }
     }
+
     // otherwise error and prints usage
+    if(!valid){
+        usage();
+    }
+    // repl if no path is given
+    else if(path == NULL){
+        repl();
+    }
+    // runs source file if a path is specified
     else{
-        fprintf(stderr,"Usage : clox [path]");
+        runFile(path);
     }
 
     // deallocates resources owned by the VM
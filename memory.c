@@ -1,41 +1,220 @@
 #include "memory.h"
 #include "vm.h"
 #include "compiler.h"
+#include "allocator.h"
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
 
 #ifdef GC_LOG
-#include <stdio.h>
 #include "debug.h"
 #endif
 
 
-void* reallocate(void *pointer,size_t oldSize,size_t newSize){
-    
-    vm.bytesAllocated += newSize - oldSize;
-    
-    if(newSize == 0){
-        free(pointer);
-        return NULL;
+// held around every use of the allocator and of vm.bytesAllocated while sweeper threads run
+static pthread_mutex_t allocatorLock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline void lockAllocator(){
+    if(vm.sweepersRunning)pthread_mutex_lock(&allocatorLock);
+}
+
+static inline void unlockAllocator(){
+    if(vm.sweepersRunning)pthread_mutex_unlock(&allocatorLock);
+}
+
+static double microseconds(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC,&now);
+    return now.tv_sec * 1e6 + now.tv_nsec / 1e3;
+}
+
+// collections run one inside the other, a pause lasts from the outermost one's start to its end
+static int pauseDepth = 0;
+static double pauseStart;
+
+static void beginPause(){
+    if(pauseDepth++ == 0)pauseStart = microseconds();
+}
+
+static void endPause(){
+    if(--pauseDepth != 0)return;
+    double pause = microseconds() - pauseStart;
+    vm.gcStats.pauseTotal += pause;
+    if(pause > vm.gcStats.pauseMax)vm.gcStats.pauseMax = pause;
+}
+
+static void collectFully();
+
+// an allocation may only fail with an error where unwinding to interpret() leaves the heap consistent
+static bool canFail(){
+    return !vm.collectingNursery && pauseDepth == 0;
+}
+
+/*
+    keeps vm.bytesAllocated under vm.gcMaxHeap: an allocation that would cross it runs a full collection first
+    and raises an out of memory error if that wasn't enough. Objects promoted by a collection are never refused.
+*/
+static void enforceHeapLimit(size_t bytes){
+    if(vm.gcMaxHeap == 0 || vm.bytesAllocated + bytes <= vm.gcMaxHeap || !canFail())return;
+    collectFully();
+    if(vm.bytesAllocated + bytes > vm.gcMaxHeap)outOfMemory(bytes);
+}
+
+// the system is out of memory, a full collection may give some back before it is tried again
+static void allocationFailed(size_t bytes){
+    if(!canFail()){
+        fprintf(stderr,"Out of memory during a collection\n");
+        exit(1);
     }
+    collectFully();
+    returnFreeMemory();
+}
 
-    if(newSize > oldSize){
+// lets the collector run before a block grows, the new memory isn't handed out yet
+static void collectBeforeAllocation(size_t oldSize,size_t newSize){
+    // a minor collection takes care of the major one once it is done
+    if(!vm.collectingNursery && newSize > oldSize){
         #ifdef GC_STRESS
         collectGarbage();
         #endif
+
+        if(vm.gcState != GC_IDLE){
+            vm.gcDebt += newSize - oldSize;
+            if(vm.gcDebt >= GC_STEP_BYTES)collectStep();
+        }
+        else if(vm.bytesAllocated > vm.nextGC){
+            // a cycle starts on an empty nursery, run() empties it at its next safe point
+            if(vm.gcPause == 0)collectGarbage();
+            else vm.nurseryFull = true;
+        }
+        enforceHeapLimit(blockSize(newSize) - blockSize(oldSize));
     }
+}
 
-    if(vm.bytesAllocated > vm.nextGC){
-        collectGarbage();
+void* reallocate(void *pointer,size_t oldSize,size_t newSize){
+    collectBeforeAllocation(oldSize,newSize);
+
+    void*result = NULL;
+    for(int attempt = 0;;attempt++){
+        lockAllocator();
+        if(newSize == 0)freeBlock(pointer,oldSize);
+        else result = resizeBlock(pointer,oldSize,newSize);
+        if(newSize == 0 || result != NULL)vm.bytesAllocated += blockSize(newSize) - blockSize(oldSize);
+        unlockAllocator();
+        if(newSize == 0 || result != NULL)return result;
+        if(attempt == 1)outOfMemory(newSize);
+        allocationFailed(newSize);
     }
+}
 
-    void *result = realloc(pointer,newSize);
-    if(result == NULL)exit(1);
-    return result;
+/*
+    mark bits are kept out of the objects: young ones in vm.nurseryMarks, old ones in the bitmap of their page.
+    Marking only writes to the bitmaps and the sweep only reads them.
+*/
+static inline bool isMarked(Obj*object){
+    if(IS_YOUNG(object))return (NURSERY_MARK_WORD(object) & NURSERY_MARK_BIT(object)) != 0;
+    return (PAGE_OF(object)->marks[BLOCK_WORD(object)] & BLOCK_BIT(object)) != 0;
+}
+
+static inline void setMarked(Obj*object){
+    if(IS_YOUNG(object)){
+        NURSERY_MARK_WORD(object) |= NURSERY_MARK_BIT(object);
+    }
+    else{
+        // neighbours share the word, the mutator marks what it allocates without holding the heap lock
+        __atomic_fetch_or(&PAGE_OF(object)->marks[BLOCK_WORD(object)],BLOCK_BIT(object),__ATOMIC_RELAXED);
+    }
+}
+
+static void sweepPage(Page*page);
+
+Obj* allocateOld(size_t size){
+    collectBeforeAllocation(0,size);
+    // the sweep is lazy, pages of the size class are swept until one has room before a new page is started
+    while(vm.gcState == GC_SWEEPING){
+        lockAllocator();
+        Page*page = needsObjectPage(size)?takeUnsweptPage(size):NULL;
+        unlockAllocator();
+        if(page == NULL)break;
+        sweepPage(page);
+    }
+    Obj*object;
+    for(int attempt = 0;;attempt++){
+        lockAllocator();
+        object = (Obj*)allocateObjectBlock(size);
+        if(object != NULL)vm.bytesAllocated += blockSize(size);
+        unlockAllocator();
+        if(object != NULL)break;
+        if(attempt == 1)outOfMemory(size);
+        allocationFailed(size);
+    }
+    // black while marking, the pages waiting for the sweep are never allocated in
+    if(vm.gcState == GC_MARKING)setMarked(object);
+    return object;
+}
+
+void freeOld(Obj*object,size_t size){
+    lockAllocator();
+    vm.bytesAllocated -= blockSize(size);
+    vm.gcStats.bytesFreed += blockSize(size);
+    freeObjectBlock(object);
+    unlockAllocator();
+}
+
+void rememberObject(Obj*object){
+    if(object->isRemembered)return;
+    object->isRemembered = true;
+    if(vm.rememberedCount + 1 > vm.rememberedCapacity){
+        vm.rememberedCapacity = GROW_CAPACITY(vm.rememberedCapacity);
+        vm.remembered = (Obj**)realloc(vm.remembered,sizeof(Obj*) * vm.rememberedCapacity);
+        if(vm.remembered == NULL)exit(1);
+    }
+    vm.remembered[vm.rememberedCount++] = object;
+}
+
+void rememberYoungString(ObjString*string){
+    if(vm.youngStringCount + 1 > vm.youngStringCapacity){
+        vm.youngStringCapacity = GROW_CAPACITY(vm.youngStringCapacity);
+        vm.youngStrings = (ObjString**)realloc(vm.youngStrings,sizeof(ObjString*) * vm.youngStringCapacity);
+        if(vm.youngStrings == NULL)exit(1);
+    }
+    vm.youngStrings[vm.youngStringCount++] = string;
+}
+
+static pthread_mutex_t heapLock = PTHREAD_MUTEX_INITIALIZER;
+// signaled when the mutator grays an object for the marker thread
+static pthread_cond_t grayReady = PTHREAD_COND_INITIALIZER;
+static pthread_t marker;
+static bool markerStop;
+
+void lockHeap(){
+    if(vm.markerRunning)pthread_mutex_lock(&heapLock);
+}
+
+void unlockHeap(){
+    if(vm.markerRunning)pthread_mutex_unlock(&heapLock);
+}
+
+void growSharedArray(void**array,size_t oldSize,size_t newSize){
+    if(!vm.markerRunning){
+        *array = reallocate(*array,oldSize,newSize);
+        return;
+    }
+    void*grown = reallocate(NULL,0,newSize);
+    if(oldSize > 0)memcpy(grown,*array,oldSize);
+    lockHeap();
+    void*old = *array;
+    *array = grown;
+    unlockHeap();
+    reallocate(old,oldSize,0);
 }
 
 void markObject(Obj*object){
-    if(object == NULL || object->isMarked)return;
-    object->isMarked = true;
+    if(object == NULL || isMarked(object))return;
+    setMarked(object);
     #ifdef GC_LOG
     printf("%p mark ", (void*)object);
     printValue(OBJ_VAL(object));
@@ -50,6 +229,18 @@ void markObject(Obj*object){
     vm.grayStack[vm.grayCount++] = object;
 }
 
+void shadeObject(Obj*object){
+    if(object == NULL || isMarked(object))return;
+    if(!vm.markerRunning){
+        markObject(object);
+        return;
+    }
+    pthread_mutex_lock(&heapLock);
+    markObject(object);
+    pthread_cond_signal(&grayReady);
+    pthread_mutex_unlock(&heapLock);
+}
+
 void markValue(Value value){
     if(IS_OBJ(value))markObject(AS_OBJ(value));
 }
@@ -63,14 +254,24 @@ void markTable(Table *table){
 }
 
 
+void markArray(ValueArray *array){
+    for(int i = 0;i < array->size;i++){
+        markValue(array->values[i]);
+    }
+}
+
 void markRoots(){
     // marking all objects on the stack
     for(Value *slot = vm.stack;slot < vm.stackTop;slot++){
         markValue(*slot);
     }
 
-    // marking the objects in the vm global table
-    markTable(&vm.globals);
+    // marking the global variables and their names
+    markTable(&vm.globalSlots);
+    markArray(&vm.globalValues);
+    markArray(&vm.globalNames);
+    markObject((Obj*)vm.initString);
+    markObject((Obj*)vm.gcStatsClass);
 
     // marking the functions in the vm callframes
     for(int i = 0;i < vm.frameCount;i++){
@@ -81,9 +282,14 @@ void markRoots(){
     markCompilerRoots();
 }
 
-void markArray(ValueArray *array){
-    for(int i = 0;i < array->size;i++){
-        markValue(array->values[i]);
+void markCaches(Chunk*chunk){
+    for(int i = 0;i < chunk->cacheCount;i++){
+        InlineCache*cache = &chunk->caches[i];
+        for(int j = 0;j < cache->count;j++){
+            markObject((Obj*)cache->entries[j].shape);
+            markObject((Obj*)cache->entries[j].transition);
+            markObject((Obj*)cache->entries[j].method);
+        }
     }
 }
 
@@ -91,23 +297,39 @@ void blackenObject(Obj*obj){
     switch(obj->type){
         case OBJ_NATIVE:
         case OBJ_STR:
+        case OBJ_BUFFER:
              break;
+        case OBJ_ROPE:
+            markObject((Obj*)((ObjRope*)obj)->buffer);
+            break;
         case OBJ_FUNCTION:{
             ObjFunction*function = (ObjFunction*)obj;
             markObject((Obj*)function->name);
             markArray(&function->chunk.constants);
+            markCaches(&function->chunk);
             break;
         }
         case OBJ_CLASS :{
             ObjClass*klass = (ObjClass*)obj;
             markObject((Obj*)klass->name);
             markTable(&klass->methods);
+            markObject((Obj*)klass->rootShape);
             break;
         }
         case OBJ_INSTANCE :{
             ObjInstance *instance = (ObjInstance*)obj;
             markObject((Obj*)instance->klass);
-            markTable(&instance->fields);
+            // read once, the mutator may add a field while the marker thread runs
+            ObjShape*shape = instance->shape;
+            if(shape != NULL){
+                markObject((Obj*)shape);
+                for(int i = 0;i < shape->fieldCount;i++){
+                    markValue(instance->fields[i]);
+                }
+            }
+            else{
+                markTable(instance->dictionary);
+            }
             break;
         }
         case OBJ_BOUND_METHOD : {
@@ -116,6 +338,13 @@ void blackenObject(Obj*obj){
             markValue(method->receiver);
             break;
         }
+        case OBJ_SHAPE : {
+            ObjShape* shape = (ObjShape*)obj;
+            markObject((Obj*)shape->parent);
+            markObject((Obj*)shape->key);
+            markTable(&shape->transitions);
+            break;
+        }
     }
     #ifdef GC_LOG
     printf("%p blacken ", (void*)obj);
@@ -124,43 +353,289 @@ void blackenObject(Obj*obj){
     #endif
 }
 
-void traceReferences(){
+// a slice ends once the clock passed its deadline, a deadline of 0 never ends it
+static bool sliceOver(int work,clock_t deadline){
+    return deadline != 0 && work % GC_CLOCK_INTERVAL == 0 && clock() >= deadline;
+}
+
+// returns true once there are no gray objects left
+bool traceReferences(clock_t deadline){
+    int work = 0;
     while(vm.grayCount > 0){
         Obj*obj = vm.grayStack[--vm.grayCount];
         blackenObject(obj);
+        if(sliceOver(++work,deadline))break;
     }
+    return vm.grayCount == 0;
 }
 
-void sweep(){
-    Obj*object = vm.objects;
-    Obj*prev = NULL;
-    while(object != NULL){
-        if(object->isMarked){
-            object->isMarked = false;
-            prev = object;
-            object = object->next;
+/*
+    frees the objects of a page whose live bit is set and mark bit isn't, and clears the marks for the next cycle.
+    Runs on the mutator or on a sweeper thread, the page belongs to whoever took it off the unswept lists.
+*/
+static void sweepPage(Page*page){
+    uint64_t dead[PAGE_BITMAP_WORDS];
+    // freeing the first dead block makes the page available, the mutator may allocate in it from then on
+    lockAllocator();
+    for(int i = 0;i < PAGE_BITMAP_WORDS;i++){
+        dead[i] = page->live[i] & ~page->marks[i];
+        page->marks[i] = 0;
+    }
+    unlockAllocator();
+    for(int i = 0;i < PAGE_BITMAP_WORDS;i++){
+        for(uint64_t word = dead[i];word != 0;word &= word - 1){
+            freeObject((Obj*)PAGE_BLOCK(page,i,__builtin_ctzll(word)));
         }
-        else{
-            Obj*unreachable = object;
-            object = object->next;
-            if(prev == NULL){
-                vm.objects = object;
-            }
-            else{
-                prev->next = object;
-            }
-            freeObject(unreachable);
+    }
+    lockAllocator();
+    sweptPage(page);
+    unlockAllocator();
+}
+
+static pthread_t sweepers[GC_SWEEP_THREADS_MAX];
+// sweeper threads that haven't run out of pages yet
+static int sweepersActive;
+
+static void*sweeperMain(void*arg){
+    for(;;){
+        lockAllocator();
+        Page*page = takeUnsweptPage(0);
+        unlockAllocator();
+        if(page == NULL)break;
+        sweepPage(page);
+    }
+    __atomic_fetch_sub(&sweepersActive,1,__ATOMIC_RELEASE);
+    return NULL;
+}
+
+static void startSweepers(){
+    vm.sweepersRunning = true;
+    sweepersActive = 0;
+    for(int i = 0;i < vm.gcSweepThreads;i++){
+        __atomic_fetch_add(&sweepersActive,1,__ATOMIC_RELAXED);
+        if(pthread_create(&sweepers[i],NULL,sweeperMain,NULL) != 0){
+            // the mutator sweeps what the threads that did start leave
+            __atomic_fetch_sub(&sweepersActive,1,__ATOMIC_RELAXED);
+            vm.gcSweepThreads = i;
+            break;
         }
     }
+    if(vm.gcSweepThreads == 0)vm.sweepersRunning = false;
+}
+
+// joins the sweeper threads once they ran out of pages, returns false if some are still busy and wait isn't set
+static bool joinSweepers(bool wait){
+    if(!vm.sweepersRunning)return true;
+    if(!wait && __atomic_load_n(&sweepersActive,__ATOMIC_ACQUIRE) > 0)return false;
+    for(int i = 0;i < vm.gcSweepThreads;i++){
+        pthread_join(sweepers[i],NULL);
+    }
+    vm.sweepersRunning = false;
+    return true;
+}
+
+void stopSweepers(){
+    joinSweepers(true);
+}
+
+/*
+    sweeps the pages marking left until the deadline, returns true once all of them are done. Objects are
+    allocated in swept and new pages meanwhile, nothing allocated after marking finished is seen by the sweep.
+*/
+bool sweep(clock_t deadline){
+    for(;;){
+        lockAllocator();
+        Page*page = takeUnsweptPage(0);
+        unlockAllocator();
+        if(page == NULL)break;
+        sweepPage(page);
+        // a page is enough work to look at the clock after each
+        if(deadline != 0 && clock() >= deadline)return false;
+    }
+    return joinSweepers(deadline == 0);
 }
 
 void tableRemoveWhite(Table*table){
-    for(int i = 0;i < table->capacity;i++){
+    for(int i = 0;i < table->capacity;){
         Entry *entry = &table->entries[i];
-        if(entry->key != NULL && !entry->key->obj.isMarked){
+        // deleting moves the next entry back into this slot, it's looked at again
+        if(entry->key != NULL && !isMarked((Obj*)entry->key)){
             tableDelete(table,entry->key);
         }
+        else i++;
+    }
+}
+
+// drops the remembered objects the sweep is about to free
+static void filterRemembered(){
+    int count = 0;
+    for(int i = 0;i < vm.rememberedCount;i++){
+        Obj*object = vm.remembered[i];
+        if(isMarked(object))vm.remembered[count++] = object;
+    }
+    vm.rememberedCount = count;
+}
+
+// everything still white is garbage, weak references to it are dropped and the object pages are handed to the sweep
+static void finishMarking(){
+    vm.gcState = GC_SWEEPING;
+    tableRemoveWhite(&vm.strings);
+    filterRemembered();
+    // young objects are marked like old ones but the sweep never sees them, a nursery emptied while marking
+    // left bits past its top as well
+    memset(vm.nurseryMarks,0,sizeof(uint64_t) * NURSERY_MARK_WORDS);
+    beginSweep();
+    if(vm.gcSweepThreads > 0)startSweepers();
+}
+
+/*
+    counts the object pages a compaction would empty, the ones less than COMPACT_OCCUPANCY percent full that
+    aren't the only page of their size class, and sets them evacuating if asked to. Also counts all the pages.
+*/
+static int sparsePages(bool evacuate,int*pages){
+    int classPages[SIZE_CLASSES] = {0};
+    *pages = 0;
+    // a large object is never moved, its page is freed with it
+    for(Page*page = objectPages();page != NULL;page = page->next){
+        if(page->sizeClass == LARGE_CLASS)continue;
+        classPages[page->sizeClass]++;
+        (*pages)++;
+    }
+    int sparse = 0;
+    for(Page*page = objectPages();page != NULL;page = page->next){
+        if(page->sizeClass != LARGE_CLASS && classPages[page->sizeClass] > 1 && page->used * 100 < pageBlocks(page) * COMPACT_OCCUPANCY){
+            if(evacuate)beginEvacuation(page);
+            sparse++;
+        }
     }
+    return sparse;
+}
+
+// a quarter of the object pages and at least COMPACT_MIN_PAGES of them would be given back
+static bool heapFragmented(){
+    int pages;
+    int sparse = sparsePages(false,&pages);
+    return sparse >= COMPACT_MIN_PAGES && sparse * 4 >= pages;
+}
+
+/*
+    the heap may grow vm.gcGrowth times before the next cycle, and at least vm.gcMinInterval bytes. vm.gcMaxHeap
+    caps it unless the heap left is already that large, the interval is all it gets then.
+*/
+static size_t nextThreshold(){
+    size_t next = (size_t)(vm.bytesAllocated * vm.gcGrowth);
+    if(next < vm.bytesAllocated + vm.gcMinInterval)next = vm.bytesAllocated + vm.gcMinInterval;
+    if(vm.gcMaxHeap != 0 && next > vm.gcMaxHeap){
+        next = vm.bytesAllocated + vm.gcMinInterval;
+        if(next < vm.gcMaxHeap)next = vm.gcMaxHeap;
+    }
+    return next;
+}
+
+static void finishCycle(){
+    vm.gcState = GC_IDLE;
+    vm.nextGC = nextThreshold();
+    vm.gcStats.cycles++;
+    if(vm.gcLog){
+        fprintf(stderr,"[gc] cycle %d done, heap %zu bytes, next at %zu bytes\n",vm.gcStats.cycles,
+            vm.bytesAllocated,vm.nextGC);
+    }
+    // objects only move at a safe point, a full nursery makes run() stop at the next one
+    if(vm.gcCompact && heapFragmented()){
+        vm.compactPending = true;
+        vm.nurseryFull = true;
+    }
+}
+
+static void*markerMain(void*arg){
+    pthread_mutex_lock(&heapLock);
+    while(!markerStop){
+        if(vm.grayCount == 0){
+            pthread_cond_wait(&grayReady,&heapLock);
+            continue;
+        }
+        for(int i = 0;i < GC_MARK_BATCH && vm.grayCount > 0;i++){
+            blackenObject(vm.grayStack[--vm.grayCount]);
+        }
+        // lets a mutator waiting for the lock in between batches
+        pthread_mutex_unlock(&heapLock);
+        sched_yield();
+        pthread_mutex_lock(&heapLock);
+    }
+    pthread_mutex_unlock(&heapLock);
+    return NULL;
+}
+
+void stopMarker(){
+    pthread_mutex_lock(&heapLock);
+    markerStop = true;
+    pthread_cond_signal(&grayReady);
+    pthread_mutex_unlock(&heapLock);
+    pthread_join(marker,NULL);
+    vm.markerRunning = false;
+}
+
+/*
+    the mutator helps the marker thread with a slice of its own so marking keeps up with allocation even
+    when the thread gets little cpu time. Returns true once there are no gray objects left, only the
+    mutator could add more.
+*/
+static bool assistMarker(clock_t deadline){
+    pthread_mutex_lock(&heapLock);
+    bool done = traceReferences(deadline);
+    pthread_mutex_unlock(&heapLock);
+    return done;
+}
+
+void startCycle(){
+    #ifdef GC_LOG
+    printf("--gc cycle begin\n");
+    #endif
+    markRoots();
+    vm.gcState = GC_MARKING;
+    vm.gcDebt = 0;
+    if(vm.gcConcurrent){
+        markerStop = false;
+        vm.markerRunning = true;
+        // without a thread the cycle falls back to slices
+        if(pthread_create(&marker,NULL,markerMain,NULL) != 0)vm.markerRunning = false;
+    }
+}
+
+static void step(){
+    vm.gcDebt = 0;
+    // the mutator outpaces the slices, the heap would keep growing until the cycle ends
+    if(vm.gcState == GC_MARKING && (vm.bytesAllocated > vm.nextGC * vm.gcGrowth
+        || (vm.gcMaxHeap != 0 && vm.bytesAllocated > vm.gcMaxHeap))){
+        collectGarbage();
+        return;
+    }
+    // with --gc-pause=0 only marking stops the world, the sweep still runs in slices
+    long pause = vm.gcPause != 0?vm.gcPause:GC_PAUSE_DEFAULT;
+    clock_t deadline = clock() + (clock_t)(pause * (CLOCKS_PER_SEC / 1000000.0));
+    if(deadline == 0)deadline = 1;
+    if(vm.gcState == GC_MARKING){
+        if(vm.markerRunning){
+            if(!assistMarker(deadline))return;
+            stopMarker();
+        }
+        else if(!traceReferences(deadline)){
+            return;
+        }
+        finishMarking();
+    }
+    if(vm.gcState == GC_SWEEPING && sweep(deadline)){
+        finishCycle();
+        #ifdef GC_LOG
+        printf("--gc cycle end, next at %zu\n",vm.nextGC);
+        #endif
+    }
+}
+
+void collectStep(){
+    beginPause();
+    step();
+    endPause();
 }
 
 void collectGarbage(){
@@ -168,16 +643,342 @@ void collectGarbage(){
     printf("--gc begin\n");
     size_t before = vm.bytesAllocated;
     #endif
+    beginPause();
 
-    markRoots();
-    traceReferences();
-    tableRemoveWhite(&vm.strings);
-    sweep();
-
-    vm.nextGC = vm.bytesAllocated * GC_GROW_RATE;
+    if(vm.gcState == GC_SWEEPING){
+        sweep(0);
+        finishCycle();
+    }
+    if(vm.markerRunning)stopMarker();
+    // a cycle in progress only has to finish, its snapshot keeps what the mutator can reach
+    if(vm.gcState == GC_IDLE){
+        markRoots();
+        vm.gcState = GC_MARKING;
+    }
+    traceReferences(0);
+    // the sweep is left to allocation and to the slices that follow, or to the sweeper threads
+    finishMarking();
+    endPause();
 
     #ifdef GC_LOG
     printf("--gc end \n");
-    printf("Collected %zu bytes (from %zu to %zu) next at %zu\n",before - vm.bytesAllocated,before,vm.bytesAllocated,vm.nextGC);
+    printf("Collected %zu bytes (from %zu to %zu), sweeping\n",before - vm.bytesAllocated,before,vm.bytesAllocated);
     #endif
+}
+
+// collects and sweeps the whole old space right away, the nursery is left alone since objects can't move here
+static void collectFully(){
+    beginPause();
+    collectGarbage();
+    sweep(0);
+    finishCycle();
+    endPause();
+}
+
+// hands the object a value refers to to the visitor and stores back what it left there
+static inline void visitValue(Value*value,ObjVisitor visit){
+    if(!IS_OBJ(*value))return;
+    Obj*object = AS_OBJ(*value);
+    visit(&object);
+    *value = OBJ_VAL(object);
+}
+
+#define VISIT_OBJ(field,visit) \
+    do{ \
+        Obj*object = (Obj*)(field); \
+        if(object != NULL){ \
+            visit(&object); \
+            (field) = (void*)object; \
+        } \
+    }while(0)
+
+// keys keep their hash when they move, entries stay in their bucket
+static void visitTable(Table*table,ObjVisitor visit){
+    for(int i = 0;i < table->capacity;i++){
+        Entry*entry = &table->entries[i];
+        VISIT_OBJ(entry->key,visit);
+        visitValue(&entry->value,visit);
+    }
+}
+
+void visitReferences(Obj*obj,ObjVisitor visit){
+    switch(obj->type){
+        case OBJ_NATIVE:
+        case OBJ_STR:
+        case OBJ_BUFFER:
+            break;
+        case OBJ_ROPE:
+            VISIT_OBJ(((ObjRope*)obj)->buffer,visit);
+            break;
+        case OBJ_FUNCTION:{
+            ObjFunction*function = (ObjFunction*)obj;
+            VISIT_OBJ(function->name,visit);
+            for(int i = 0;i < function->chunk.constants.size;i++){
+                visitValue(&function->chunk.constants.values[i],visit);
+            }
+            for(int i = 0;i < function->chunk.cacheCount;i++){
+                InlineCache*cache = &function->chunk.caches[i];
+                for(int j = 0;j < cache->count;j++){
+                    VISIT_OBJ(cache->entries[j].shape,visit);
+                    VISIT_OBJ(cache->entries[j].transition,visit);
+                    VISIT_OBJ(cache->entries[j].method,visit);
+                }
+            }
+            break;
+        }
+        case OBJ_CLASS:{
+            ObjClass*klass = (ObjClass*)obj;
+            VISIT_OBJ(klass->name,visit);
+            visitTable(&klass->methods,visit);
+            VISIT_OBJ(klass->rootShape,visit);
+            break;
+        }
+        case OBJ_INSTANCE:{
+            ObjInstance*instance = (ObjInstance*)obj;
+            VISIT_OBJ(instance->klass,visit);
+            if(instance->shape != NULL){
+                VISIT_OBJ(instance->shape,visit);
+                for(int i = 0;i < instance->shape->fieldCount;i++){
+                    visitValue(&instance->fields[i],visit);
+                }
+            }
+            else{
+                visitTable(instance->dictionary,visit);
+            }
+            break;
+        }
+        case OBJ_BOUND_METHOD:{
+            ObjBoundMethod*method = (ObjBoundMethod*)obj;
+            VISIT_OBJ(method->method,visit);
+            visitValue(&method->receiver,visit);
+            break;
+        }
+        case OBJ_SHAPE:{
+            ObjShape*shape = (ObjShape*)obj;
+            VISIT_OBJ(shape->parent,visit);
+            VISIT_OBJ(shape->key,visit);
+            visitTable(&shape->transitions,visit);
+            break;
+        }
+    }
+}
+
+// where a forwarded young object keeps the address of its copy, every object is large enough
+#define FORWARDING(obj) (((Obj**)(obj))[1])
+
+/*
+    copies an object into the object pages and leaves a forwarding pointer to the copy in its body. The copy
+    shares the arrays the object owned.
+*/
+static Obj* moveObject(Obj*object,size_t size){
+    Obj*copy = allocateOld(size);
+    memcpy(copy,object,size);
+    if(object->type == OBJ_INSTANCE){
+        ObjInstance*instance = (ObjInstance*)copy;
+        if(((ObjInstance*)object)->fields == ((ObjInstance*)object)->inlineFields){
+            instance->fields = instance->inlineFields;
+        }
+    }
+    copy->isRemembered = false;
+    object->isForwarded = true;
+    FORWARDING(object) = copy;
+    return copy;
+}
+
+/*
+    copies a young object into the old space the first time it is reached, later references to it are pointed
+    at the copy through the forwarding pointer.
+*/
+static void evacuate(Obj**slot){
+    Obj*object = *slot;
+    if(!IS_YOUNG(object))return;
+    if(object->isForwarded){
+        *slot = FORWARDING(object);
+        return;
+    }
+    // promoted during marking it is black like allocated after the cycle started, allocateOld() took care of it
+    Obj*copy = moveObject(object,objectSize(object));
+    // scanned for young references of its own along with the remembered objects
+    rememberObject(copy);
+    *slot = copy;
+}
+
+// the references the VM itself holds, outside of any object
+static void visitRoots(ObjVisitor visit){
+    for(Value*slot = vm.stack;slot < vm.stackTop;slot++){
+        visitValue(slot,visit);
+    }
+    for(int i = 0;i < vm.frameCount;i++){
+        VISIT_OBJ(vm.frames[i].function,visit);
+    }
+    VISIT_OBJ(vm.initString,visit);
+    VISIT_OBJ(vm.gcStatsClass,visit);
+    // global values and names are few, they are scanned instead of putting a barrier on every global store
+    for(int i = 0;i < vm.globalValues.size;i++){
+        visitValue(&vm.globalValues.values[i],visit);
+    }
+    for(int i = 0;i < vm.globalNames.size;i++){
+        visitValue(&vm.globalNames.values[i],visit);
+    }
+    visitTable(&vm.globalSlots,visit);
+}
+
+// moves the interned strings that survived along with vm.strings' keys, forgets the others
+static void sweepYoungStrings(){
+    for(int i = 0;i < vm.youngStringCount;i++){
+        ObjString*string = vm.youngStrings[i];
+        // the forwarding pointer overwrote its length and first chars, the hash is still there for the lookup
+        if(string->obj.isForwarded){
+            tableRekey(&vm.strings,string,(ObjString*)FORWARDING(string));
+        }
+        else{
+            tableDelete(&vm.strings,string);
+        }
+    }
+    vm.youngStringCount = 0;
+}
+
+// points a reference to a moved object at its copy
+static void relocate(Obj**slot){
+    if((*slot)->isForwarded)*slot = FORWARDING(*slot);
+}
+
+// calls visit on the references of every old object outside of the evacuated pages
+static void visitOldObjects(ObjVisitor visit){
+    for(Page*page = objectPages();page != NULL;page = page->next){
+        if(page->isEvacuating)continue;
+        for(int i = 0;i < PAGE_BITMAP_WORDS;i++){
+            for(uint64_t live = page->live[i];live != 0;live &= live - 1){
+                visitReferences((Obj*)PAGE_BLOCK(page,i,__builtin_ctzll(live)),visit);
+            }
+        }
+    }
+}
+
+/*
+    moves the objects of the sparse object pages into the others and frees those pages. Runs on an empty nursery
+    outside of a cycle, so every reference to an old object is in the roots, the old objects and the keys of
+    vm.strings.
+*/
+static void compactHeap(){
+    #ifdef GC_LOG
+    printf("--compaction begin\n");
+    #endif
+    vm.compactPending = false;
+    // the copies are allocated like promoted objects, nothing may start a collection meanwhile
+    vm.collectingNursery = true;
+
+    int pages;
+    if(sparsePages(true,&pages) == 0){
+        vm.collectingNursery = false;
+        return;
+    }
+
+    // the copies go to pages in front of the list or to pages that aren't evacuated
+    for(Page*page = objectPages();page != NULL;page = page->next){
+        if(!page->isEvacuating)continue;
+        for(int i = 0;i < PAGE_BITMAP_WORDS;i++){
+            for(uint64_t live = page->live[i];live != 0;live &= live - 1){
+                Obj*object = (Obj*)PAGE_BLOCK(page,i,__builtin_ctzll(live));
+                size_t size = objectSize(object);
+                moveObject(object,size);
+                vm.bytesAllocated -= blockSize(size);
+            }
+        }
+    }
+
+    visitRoots(relocate);
+    visitTable(&vm.strings,relocate);
+    visitOldObjects(relocate);
+    // only forwarded objects are left in the evacuated pages
+    for(Page*page = objectPages();page != NULL;){
+        Page*next = page->next;
+        if(page->isEvacuating)releaseEvacuatedPage(page);
+        page = next;
+    }
+    returnFreeMemory();
+
+    vm.collectingNursery = false;
+    #ifdef GC_LOG
+    printf("--compaction end\n");
+    #endif
+}
+
+void collectNursery(){
+    #ifdef GC_LOG
+    printf("--minor gc begin\n");
+    size_t before = vm.bytesAllocated;
+    #endif
+    beginPause();
+    double start = microseconds();
+    size_t promoted = vm.bytesAllocated;
+    vm.collectingNursery = true;
+    // objects move and old ones get their references rewritten, the marker thread waits
+    lockHeap();
+
+    visitRoots(evacuate);
+
+    // promoted copies are remembered as well, scan until no new ones show up
+    while(vm.rememberedCount > 0){
+        Obj*object = vm.remembered[--vm.rememberedCount];
+        object->isRemembered = false;
+        visitReferences(object,evacuate);
+    }
+
+    sweepYoungStrings();
+
+    // whatever wasn't copied is garbage, only the arrays it owned need freeing
+    for(uint8_t*top = vm.nursery;top < vm.nurseryTop;){
+        Obj*object = (Obj*)top;
+        // a forwarded string lost its length to the forwarding pointer, the copy has the same size
+        size_t size = objectSize(object->isForwarded?FORWARDING(object):object);
+        top += size;
+        if(!object->isForwarded){
+            freeObjectContents(object);
+            vm.gcStats.bytesFreed += size;
+        }
+    }
+    vm.nurseryTop = vm.nursery;
+    vm.nurseryFull = false;
+    unlockHeap();
+    vm.collectingNursery = false;
+
+    #ifdef GC_LOG
+    printf("--minor gc end, promoted %zu bytes\n",vm.bytesAllocated - before);
+    #endif
+    vm.gcStats.minorCollections++;
+    if(vm.gcLog){
+        fprintf(stderr,"[gc] minor collection %d, promoted %zu bytes in %.3f ms\n",vm.gcStats.minorCollections,
+            vm.bytesAllocated - promoted,(microseconds() - start) / 1000);
+    }
+
+    if(vm.gcState != GC_IDLE){
+        collectStep();
+    }
+    else if(vm.bytesAllocated > vm.nextGC){
+        if(vm.gcPause == 0)collectGarbage();
+        else startCycle();
+    }
+    // the nursery is still empty, only old objects are left to move
+    if(vm.compactPending && vm.gcState == GC_IDLE)compactHeap();
+    endPause();
+}
+
+void countHeapBytes(size_t*bytes){
+    memset(bytes,0,sizeof(size_t) * OBJ_TYPE_COUNT);
+    // sweeper threads may be freeing objects, a live bit is only cleared under the lock
+    lockAllocator();
+    for(Page*page = objectPages();page != NULL;page = page->next){
+        for(int i = 0;i < PAGE_BITMAP_WORDS;i++){
+            for(uint64_t live = page->live[i];live != 0;live &= live - 1){
+                bytes[((Obj*)PAGE_BLOCK(page,i,__builtin_ctzll(live)))->type] += page->blockSize;
+            }
+        }
+    }
+    unlockAllocator();
+    for(uint8_t*top = vm.nursery;top < vm.nurseryTop;){
+        Obj*object = (Obj*)top;
+        top += objectSize(object);
+        bytes[object->type] += objectSize(object);
+    }
 }
\ No newline at end of file
@@ -5,31 +5,140 @@
 #include "object.h"
 
 
+// defaults of vm.nextGC and vm.gcGrowth, --gc-initial-heap and --gc-growth change them
+#define GC_INITIAL_HEAP (1024 * 1024)
 #define GC_GROW_RATE 2
 
+// default pause target of a collection slice in microseconds
+#define GC_PAUSE_DEFAULT 1000
+// a slice runs each time this many bytes were allocated while a cycle is in progress
+#define GC_STEP_BYTES (64 * 1024)
+// objects a slice processes between two looks at the clock
+#define GC_CLOCK_INTERVAL 64
+// objects the marker thread blackens each time it holds the heap lock
+#define GC_MARK_BATCH 256
+// most sweeper threads --gc-sweep-threads may ask for
+#define GC_SWEEP_THREADS_MAX 8
+// with --gc-compact a cycle leaving at least COMPACT_MIN_PAGES object pages less than COMPACT_OCCUPANCY
+// percent full, and a quarter of them at least, is followed by a compaction
+#define COMPACT_MIN_PAGES 16
+#define COMPACT_OCCUPANCY 50
+
+/*
+    new objects are bump allocated in the nursery, a minor collection copies the ones still reachable into
+    the old space (the object pages of allocator.c) and empties it
+*/
+#define NURSERY_SIZE (1024 * 1024)
+// larger objects are allocated old right away, copying them out of the nursery would cost more than it saves
+#define NURSERY_OBJECT_MAX (NURSERY_SIZE / 8)
+// objects in the nursery start at multiples of this
+#define OBJECT_ALIGNMENT 8
+#define ALIGN_OBJECT(size) (((size) + OBJECT_ALIGNMENT - 1) & ~(size_t)(OBJECT_ALIGNMENT - 1))
+
+// the object lives in the nursery
+#define IS_YOUNG(obj) ((uintptr_t)(obj) - (uintptr_t)vm.nursery < NURSERY_SIZE)
+
+// the nursery's mark bitmap has a bit for each OBJECT_ALIGNMENT bytes, old objects use their page's
+#define NURSERY_MARK_WORDS (NURSERY_SIZE / OBJECT_ALIGNMENT / 64)
+#define NURSERY_MARK_INDEX(obj) ((size_t)((uint8_t*)(obj) - vm.nursery) / OBJECT_ALIGNMENT)
+#define NURSERY_MARK_WORD(obj) (vm.nurseryMarks[NURSERY_MARK_INDEX(obj) / 64])
+#define NURSERY_MARK_BIT(obj) ((uint64_t)1 << (NURSERY_MARK_INDEX(obj) % 64))
+
+/*
+    write barrier, placed before storing a reference into an object that may be old. Old objects holding
+    references into the nursery are remembered, a minor collection treats them as roots.
+*/
+#define WRITE_BARRIER_OBJ(owner,ref) \
+    do{ \
+        Obj*barrierRef = (Obj*)(ref); \
+        if(barrierRef != NULL && IS_YOUNG(barrierRef) && !((Obj*)(owner))->isRemembered && !IS_YOUNG(owner)){ \
+            rememberObject((Obj*)(owner)); \
+        } \
+    }while(0)
+#define WRITE_BARRIER(owner,value) \
+    do{ \
+        if(IS_OBJ(value))WRITE_BARRIER_OBJ(owner,AS_OBJ(value)); \
+    }while(0)
+
+/*
+    deletion barrier, placed before a reference held by an old object is overwritten. While marking every object
+    reachable when the cycle started is kept alive, so the reference being dropped is shaded gray.
+*/
+#define SHADE_OBJ(ref) \
+    do{ \
+        if(vm.gcState == GC_MARKING)shadeObject((Obj*)(ref)); \
+    }while(0)
+#define SHADE(value) \
+    do{ \
+        if(vm.gcState == GC_MARKING && IS_OBJ(value))shadeObject(AS_OBJ(value)); \
+    }while(0)
+
 // decides new Capacity value once capacity is full
 #define GROW_CAPACITY(capacity) ((capacity < 8) ? 8 : 2 * capacity);
 
 
 // dynamically grows the array 
-#define GROW_ARRAY(type,pointer,oldCapacity,newCapacity) (type*)reallocate(pointer,sizeof(type) * oldCapacity,sizeof(type) * newCapacity)
+#define GROW_ARRAY(type,pointer,oldCapacity,newCapacity) (type*)reallocate(pointer,sizeof(type) * (oldCapacity),sizeof(type) * (newCapacity))
 
 
 // frees the array
-#define FREE_ARRAY(type,pointer,capacity) reallocate(pointer,sizeof(type) * capacity,0)
+#define FREE_ARRAY(type,pointer,capacity) reallocate(pointer,sizeof(type) * (capacity),0)
 
 #define FREE(type,pointer) reallocate(pointer,sizeof(type),0)
 
+// GROW_ARRAY for arrays the marker thread may be reading, the old array is only freed once the new one is in place
+#define GROW_SHARED_ARRAY(type,pointer,oldCapacity,newCapacity) \
+    growSharedArray((void**)&(pointer),sizeof(type) * (oldCapacity),sizeof(type) * (newCapacity))
+
 // resizes pointed memory block from oldSize to newSize
 void* reallocate(void *pointer,size_t oldSize,size_t newSize);
+void growSharedArray(void**array,size_t oldSize,size_t newSize);
 
-// starts the garbage collector
+// allocates an old object in the object pages, already marked when the running cycle must keep it
+Obj* allocateOld(size_t size);
+// frees the memory of an old object, what it owns has to be freed first
+void freeOld(Obj*object,size_t size);
+
+// held by the marker thread while it blackens objects, the mutator takes it to replace or free what they own
+void lockHeap();
+void unlockHeap();
+// waits for the marker thread to stop, whatever it left gray stays on the gray stack
+void stopMarker();
+// waits for the sweeper threads to sweep the pages left and stop
+void stopSweepers();
+
+// marks the whole heap at once, finishing the cycle in progress if there is one. The sweep is lazy, pages are
+// swept as allocation needs them and in slices afterwards
 
 void collectGarbage();
 
+// starts an incremental cycle, the nursery has to be empty
+void startCycle();
+// advances the cycle in progress by one slice of at most vm.gcPause microseconds
+void collectStep();
+
+// promotes the reachable young objects and empties the nursery, only safe where no C local points at an object
+void collectNursery();
+
+// adds up the bytes the objects in the heap take by type, garbage not swept yet and the whole nursery included.
+// bytes has OBJ_TYPE_COUNT entries
+void countHeapBytes(size_t*bytes);
+
+// adds an old object to vm.remembered
+void rememberObject(Obj*object);
+// notes an interned string allocated in the nursery, a minor collection fixes or drops its vm.strings entry
+void rememberYoungString(ObjString*string);
+
 // marks an object
 void markObject(Obj*object);
+// markObject for the mutator, safe while the marker thread runs
+void shadeObject(Obj*object);
+
+// called with the address of every reference an object holds, may update it
+typedef void (*ObjVisitor)(Obj**slot);
+// calls visit on each object reference held by obj, its fields, tables and caches included
+void visitReferences(Obj*obj,ObjVisitor visit);
 
-#define ALLOCATE(type,size) (type*)reallocate(NULL,0,sizeof(type) * size)
+#define ALLOCATE(type,size) (type*)reallocate(NULL,0,sizeof(type) * (size))
 
 #endif
\ No newline at end of file
@@ -6,12 +6,34 @@
 #include <inttypes.h>
 
 
+/*
+    bumps the nursery's top. Once an object doesn't fit the nursery is full until run() reaches a safe point
+    and collects it, meanwhile objects are made old right away and remembered as their fields may be set to
+    young objects while they are built.
+*/
 static Obj* allocateObject(size_t size,ObjType type){
-    Obj *obj = (Obj*)reallocate(NULL,0,size);
+    size = ALIGN_OBJECT(size);
+    Obj *obj;
+    if(size <= NURSERY_OBJECT_MAX && !vm.nurseryFull && vm.nurseryTop + size <= vm.nursery + NURSERY_SIZE){
+        #ifdef GC_STRESS
+        collectGarbage();
+        #endif
+        obj = (Obj*)vm.nurseryTop;
+        vm.nurseryTop += size;
+        obj->isRemembered = false;
+        obj->isForwarded = false;
+        // objects allocated while marking are black, the cycle only collects what was garbage when it started
+        if(vm.gcState == GC_MARKING)NURSERY_MARK_WORD(obj) |= NURSERY_MARK_BIT(obj);
+    }
+    else{
+        // an object too large to be worth copying is made old without filling the nursery
+        if(size <= NURSERY_OBJECT_MAX)vm.nurseryFull = true;
+        obj = allocateOld(size);
+        obj->isRemembered = false;
+        obj->isForwarded = false;
+        rememberObject(obj);
+    }
     obj->type = type;
-    obj->isMarked = false;
-    obj->next = vm.objects;
-    vm.objects = obj;
     #ifdef GC_LOG
     printf("%p allocated %zu bytes of type %d\n",(void*)obj,size,type);
     #endif
@@ -21,60 +43,88 @@ static Obj* allocateObject(size_t size,ObjType type){
 #define ALLOCATE_OBJ(type,objectType) (type*)allocateObject(sizeof(type),objectType)
 
 
-ObjString *allocateString(char *chars,int length,uint32_t hash){
-    ObjString*string = ALLOCATE_OBJ(ObjString,OBJ_STR);
-    string->chars = chars;
+ObjString* allocateString(int length){
+    ObjString*string = (ObjString*)allocateObject(sizeof(ObjString) + length + 1,OBJ_STR);
+    string->hash = 0;
     string->length = length;
+    string->isInterned = false;
+    string->chars[length] = '\0';
+    return string;
+}
+
+// adds a string nothing equal to was interned yet to vm.strings
+static ObjString* addInterned(ObjString*string,uint32_t hash){
     string->hash = hash;
+    string->isInterned = true;
     push(OBJ_VAL(string));
     tableSet(&vm.strings,string,NIL_VAL);
+    if(IS_YOUNG(string))rememberYoungString(string);
     pop();
     return string;
 }
 
-// FNV-1a Hashing algorithm
-
-uint32_t hashString(const char*key,int length){
-    uint32_t hash = 2166136261u;
-    for (int i = 0; i < length; i++) {
-        hash ^= (uint8_t)key[i];
-        hash *= 16777619;
-    }
-    return hash;
-}
 ObjString* tableFindString(Table*table,const char*chars,int length,uint32_t hash){
 
     if(table->count == 0)return NULL;
     
-    uint32_t bucket = hash & (table->capacity - 1);
-    for(;;){
-        Entry*entry = &table->entries[bucket];
-        if(entry->key == NULL){
-            if(IS_NIL(entry->value))return NULL;
-        }
-        else if(entry->key->hash == hash && entry->key->length == length 
+    int mask = table->capacity - 1;
+    int index = hash & mask;
+    for(int distance = 0;;distance++){
+        Entry*entry = &table->entries[index];
+        if(entry->key == NULL || entryDistance(entry,index,mask) < distance)return NULL;
+        // the stored hash rules out most other strings before their chars are read
+        if(entry->hash == hash && entry->key->length == length 
         && (memcmp(entry->key->chars,chars,length)) == 0){
+            // the string may have been garbage when the cycle started, it's reachable again
+            SHADE_OBJ(entry->key);
             return entry->key;
         }
-        bucket = (bucket + 1) & (table->capacity - 1);
+        index = (index + 1) & mask;
     }
 }
 
 ObjString* copyString(const char *chars,int length){
-   
-    uint32_t hash = hashString(chars,length);
+    return copyHashedString(chars,length,hashString(chars,length));
+}
+
+ObjString* copyHashedString(const char*chars,int length,uint32_t hash){
     ObjString*interned = tableFindString(&vm.strings,chars,length,hash);
     if(interned != NULL)return interned;
     
-    char *heapChars = ALLOCATE(char,length + 1);
-    memcpy(heapChars,chars,length);
-    heapChars[length] = '\0';
-    return allocateString(heapChars,length,hash);
+    ObjString*string = allocateString(length);
+    memcpy(string->chars,chars,length);
+    return addInterned(string,hash);
+}
+
+ObjString* internString(ObjString*string){
+    if(string->isInterned)return string;
+    uint32_t hash = hashString(string->chars,string->length);
+    ObjString*interned = tableFindString(&vm.strings,string->chars,string->length,hash);
+    // the copy is left to the collector
+    if(interned != NULL)return interned;
+    return addInterned(string,hash);
+}
+
+size_t objectSize(Obj*obj){
+    switch(obj->type){
+        case OBJ_STR: return ALIGN_OBJECT(sizeof(ObjString) + ((ObjString*)obj)->length + 1);
+        case OBJ_FUNCTION: return ALIGN_OBJECT(sizeof(ObjFunction));
+        case OBJ_NATIVE: return ALIGN_OBJECT(sizeof(ObjNative));
+        case OBJ_CLASS: return ALIGN_OBJECT(sizeof(ObjClass));
+        case OBJ_INSTANCE:
+            return ALIGN_OBJECT(sizeof(ObjInstance) + sizeof(Value) * ((ObjInstance*)obj)->inlineCapacity);
+        case OBJ_BOUND_METHOD: return ALIGN_OBJECT(sizeof(ObjBoundMethod));
+        case OBJ_SHAPE: return ALIGN_OBJECT(sizeof(ObjShape));
+        case OBJ_BUFFER: return ALIGN_OBJECT(sizeof(ObjBuffer));
+        case OBJ_ROPE: return ALIGN_OBJECT(sizeof(ObjRope));
+        default: return 0;
+    }
 }
 
 ObjFunction* newFunction(){
     ObjFunction*function = ALLOCATE_OBJ(ObjFunction,OBJ_FUNCTION);
     function->arity = 0;
+    function->maxStack = 0;
     function->name = NULL;
     initChunk(&function->chunk);
     return function;
@@ -89,17 +139,179 @@ ObjNative*newNative(NativeFn fn){
 ObjClass *newClass(ObjString*name){
     ObjClass*klass = ALLOCATE_OBJ(ObjClass,OBJ_CLASS);
     klass->name = name;
+    klass->rootShape = NULL;
+    klass->instanceSlots = 0;
     initTable(&klass->methods);
+    push(OBJ_VAL(klass));
+    klass->rootShape = newShape(NULL,NULL);
+    pop();
     return klass;
 }
 
 ObjInstance *newInstance(ObjClass *klass){
-    ObjInstance *instance = ALLOCATE_OBJ(ObjInstance,OBJ_INSTANCE);
+    int slots = klass->instanceSlots;
+    ObjInstance *instance = (ObjInstance*)allocateObject(sizeof(ObjInstance) + sizeof(Value) * slots,OBJ_INSTANCE);
     instance->klass = klass;
-    initTable(&instance->fields);
+    instance->shape = klass->rootShape;
+    instance->fields = instance->inlineFields;
+    instance->fieldCapacity = slots;
+    instance->inlineCapacity = slots;
+    instance->dictionary = NULL;
+    for(int i = 0;i < slots;i++){
+        instance->inlineFields[i] = NIL_VAL;
+    }
     return instance;
 }
 
+ObjShape *newShape(ObjShape*parent,ObjString*key){
+    ObjShape*shape = ALLOCATE_OBJ(ObjShape,OBJ_SHAPE);
+    shape->parent = parent;
+    shape->key = key;
+    shape->fieldCount = parent == NULL?0:parent->fieldCount + 1;
+    initTable(&shape->transitions);
+    return shape;
+}
+
+int shapeSlot(ObjShape*shape,ObjString*key){
+    for(;shape->key != NULL;shape = shape->parent){
+        if(shape->key == key)return shape->fieldCount - 1;
+    }
+    return -1;
+}
+
+ObjShape *shapeTransition(ObjShape*shape,ObjString*key){
+    Value next;
+    if(tableGet(&shape->transitions,key,&next)){
+        return (ObjShape*)AS_OBJ(next);
+    }
+    ObjShape*child = newShape(shape,key);
+    push(OBJ_VAL(child));
+    WRITE_BARRIER_OBJ(&shape->obj,child);
+    WRITE_BARRIER_OBJ(&shape->obj,key);
+    tableSet(&shape->transitions,key,OBJ_VAL(child));
+    pop();
+    return child;
+}
+
+bool instanceGetField(ObjInstance*instance,ObjString*name,Value*value){
+    if(instance->shape == NULL){
+        return tableGet(instance->dictionary,name,value);
+    }
+    int slot = shapeSlot(instance->shape,name);
+    if(slot == -1)return false;
+    *value = instance->fields[slot];
+    return true;
+}
+
+void instanceAddField(ObjInstance*instance,ObjShape*shape,Value value){
+    int count = shape->fieldCount;
+    if(count > instance->fieldCapacity){
+        int oldCapacity = instance->fieldCapacity;
+        int capacity = GROW_CAPACITY(oldCapacity);
+        if(instance->fields == instance->inlineFields){
+            Value*fields = ALLOCATE(Value,capacity);
+            memcpy(fields,instance->inlineFields,sizeof(Value) * oldCapacity);
+            instance->fields = fields;
+        }
+        else{
+            GROW_SHARED_ARRAY(Value,instance->fields,oldCapacity,capacity);
+        }
+        for(int i = oldCapacity;i < capacity;i++){
+            instance->fields[i] = NIL_VAL;
+        }
+        instance->fieldCapacity = capacity;
+    }
+    WRITE_BARRIER(&instance->obj,value);
+    WRITE_BARRIER_OBJ(&instance->obj,shape);
+    SHADE_OBJ(instance->shape);
+    instance->fields[count - 1] = value;
+    // the marker thread may only see the new shape once the field it adds is stored
+    __atomic_store_n(&instance->shape,shape,__ATOMIC_RELEASE);
+    if(count > instance->klass->instanceSlots){
+        instance->klass->instanceSlots = count;
+    }
+}
+
+// moves the fields of the instance into a table keyed by name
+static void toDictionaryMode(ObjInstance*instance){
+    Table*dictionary = ALLOCATE(Table,1);
+    initTable(dictionary);
+    for(ObjShape*shape = instance->shape;shape->key != NULL;shape = shape->parent){
+        WRITE_BARRIER_OBJ(&instance->obj,shape->key);
+        tableSet(dictionary,shape->key,instance->fields[shape->fieldCount - 1]);
+    }
+    SHADE_OBJ(instance->shape);
+    Value*fields = instance->fields;
+    lockHeap();
+    instance->dictionary = dictionary;
+    instance->fields = instance->inlineFields;
+    instance->shape = NULL;
+    unlockHeap();
+    if(fields != instance->inlineFields){
+        FREE_ARRAY(Value,fields,instance->fieldCapacity);
+    }
+    instance->fieldCapacity = instance->inlineCapacity;
+}
+
+void instanceSetField(ObjInstance*instance,ObjString*name,Value value){
+    if(instance->shape != NULL){
+        int slot = shapeSlot(instance->shape,name);
+        if(slot != -1){
+            WRITE_BARRIER(&instance->obj,value);
+            SHADE(instance->fields[slot]);
+            instance->fields[slot] = value;
+            return;
+        }
+        if(instance->shape->fieldCount < SHAPE_MAX_FIELDS){
+            instanceAddField(instance,shapeTransition(instance->shape,name),value);
+            return;
+        }
+        toDictionaryMode(instance);
+    }
+    WRITE_BARRIER_OBJ(&instance->obj,name);
+    WRITE_BARRIER(&instance->obj,value);
+    tableSet(instance->dictionary,name,value);
+}
+
+// grows the buffer to hold at least capacity chars, doubling it so appending is linear
+static void reserveBuffer(ObjBuffer*buffer,int capacity){
+    if(capacity <= buffer->capacity)return;
+    int oldCapacity = buffer->capacity;
+    if(capacity < oldCapacity * 2)capacity = oldCapacity * 2;
+    buffer->chars = GROW_ARRAY(char,buffer->chars,oldCapacity,capacity);
+    buffer->capacity = capacity;
+}
+
+// the buffer is rooted on the stack, in the STACK_HEADROOM slots call() keeps free above the frame's maxStack
+ObjRope* concatenateRope(Value a,Value b){
+    int length = stringLength(a) + stringLength(b);
+    ObjBuffer*buffer;
+    if(IS_ROPE(a) && AS_ROPE(a)->length == AS_ROPE(a)->buffer->length){
+        // no rope has chars past a's yet, b's go right after them
+        buffer = AS_ROPE(a)->buffer;
+        push(OBJ_VAL(buffer));
+    }
+    else{
+        buffer = ALLOCATE_OBJ(ObjBuffer,OBJ_BUFFER);
+        buffer->length = 0;
+        buffer->capacity = 0;
+        buffer->chars = NULL;
+        push(OBJ_VAL(buffer));
+        reserveBuffer(buffer,length);
+        memcpy(buffer->chars,stringChars(a),stringLength(a));
+        buffer->length = stringLength(a);
+    }
+    // b may be a rope of this buffer, its chars are only read once the buffer has grown
+    reserveBuffer(buffer,length);
+    memcpy(buffer->chars + buffer->length,stringChars(b),stringLength(b));
+    buffer->length = length;
+    ObjRope*rope = ALLOCATE_OBJ(ObjRope,OBJ_ROPE);
+    rope->length = length;
+    rope->buffer = buffer;
+    pop();
+    return rope;
+}
+
 ObjBoundMethod *newBoundMethod(ObjFunction*function,Value receiver){
     ObjBoundMethod*method = ALLOCATE_OBJ(ObjBoundMethod,OBJ_BOUND_METHOD);
     method->method = function;
@@ -136,6 +348,15 @@ void printObject(Value value){
         case OBJ_BOUND_METHOD:
             printFunction(AS_BOUND_METHOD(value)->method);
             break;
+        case OBJ_SHAPE:
+            printf("<shape>");
+            break;
+        case OBJ_BUFFER:
+            printf("<buffer>");
+            break;
+        case OBJ_ROPE:
+            printf("%.*s",AS_ROPE(value)->length,AS_ROPE(value)->buffer->chars);
+            break;
         default:
             return;
     }
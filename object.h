@@ -4,6 +4,7 @@
 #include "memory.h"
 #include "table.h"
 #include "chunk.h"
+#include "hash.h"
 
 
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
@@ -13,6 +14,9 @@
 #define IS_CLASS(value) isObjType(value,OBJ_CLASS)
 #define IS_INSTANCE(value) isObjType(value,OBJ_INSTANCE)
 #define IS_BOUND_METHOD(value) isObjType(value,OBJ_BOUND_METHOD)
+#define IS_ROPE(value) isObjType(value,OBJ_ROPE)
+// a string or a rope, what + concatenates
+#define IS_ANY_STRING(value) (IS_OBJ(value) && (AS_OBJ(value)->type == OBJ_STR || AS_OBJ(value)->type == OBJ_ROPE))
 
 
 typedef enum{
@@ -22,20 +26,41 @@ typedef enum{
     OBJ_CLASS,
     OBJ_INSTANCE,
     OBJ_BOUND_METHOD,
+    OBJ_SHAPE,
+    OBJ_BUFFER,
+    OBJ_ROPE,
 }ObjType;
 
+#define OBJ_TYPE_COUNT (OBJ_ROPE + 1)
+
+// an instance switches to dictionary mode instead of growing its shape past this many fields
+#define SHAPE_MAX_FIELDS 32
+// concatenations this long make a rope, shorter ones a flat string
+#define ROPE_MIN 256
+
+// the header is a single word, mark bits live in side bitmaps instead (see memory.c)
 struct Obj{
-    ObjType type;
-    Obj*next;
-    bool isMarked;
+    uint32_t type : 8;
+    // old object listed in vm.remembered, it may hold references into the nursery
+    uint32_t isRemembered : 1;
+    // young object a minor collection copied, the word after the header points at the copy
+    uint32_t isForwarded : 1;
 };
 
 
+/*
+    identifiers and constants are interned in vm.strings, equal ones are the same object. Strings built at
+    runtime aren't, they are neither hashed nor looked up unless internString() is asked to.
+*/
 struct ObjString{
     Obj obj;
-    int length;
-    char *chars;
+    // ahead of the word a forwarding pointer overwrites, a minor collection still finds the string in vm.strings.
+    // Only set once the string is interned
     uint32_t hash;
+    int length;
+    bool isInterned;
+    // length chars and a terminating NUL, allocated with the string
+    char chars[];
 };
 
 // function object struct 
@@ -44,18 +69,68 @@ struct ObjFunction{
     ObjString*name; // name of functionn
     Chunk chunk; // function's chunk to which its bytecode will be emitted
     int arity; // no of arguements of the function
+    int maxStack; // stack slots a call needs from its callee slot up, computed once the function is compiled, call() adds STACK_HEADROOM
+};
+
+/*
+    hidden class shared by all instances of a class that added the same fields in the same order,
+    it maps field names to slots of the instance's fields array
+*/
+struct ObjShape{
+    Obj obj;
+    // shape this one was reached from, NULL for the root shape of a class
+    ObjShape*parent;
+    // field added by the transition from the parent, its slot is fieldCount - 1
+    ObjString*key;
+    // number of fields of instances with this shape
+    int fieldCount;
+    // shapes reached by adding one more field, field name -> shape
+    Table transitions;
 };
 
 struct ObjClass{
     Obj obj;
     ObjString*name;
     Table methods;
+    // shape of instances without fields
+    ObjShape*rootShape;
+    // most fields an instance of this class had so far, new instances reserve that many inline slots
+    int instanceSlots;
 };
 
 struct ObjInstance{
     Obj obj;
     ObjClass*klass;
-    Table fields;
+    // layout of fields, NULL once the instance switched to dictionary mode
+    ObjShape*shape;
+    // field values in shape order, points at inlineFields until they overflow
+    Value*fields;
+    int fieldCapacity;
+    // number of slots allocated with the instance itself
+    int inlineCapacity;
+    // fields by name in dictionary mode, NULL otherwise
+    Table*dictionary;
+    Value inlineFields[];
+};
+
+// chars concatenation appends to, shared by the ropes built from them
+struct ObjBuffer{
+    Obj obj;
+    int length;
+    int capacity;
+    char*chars;
+};
+
+/*
+    string made by a concatenation: the first length chars of its buffer. A rope as long as its buffer can be
+    extended by appending to the buffer, the ropes sharing it only see the chars they had, so building a long
+    string piece by piece copies each piece once. Ropes are never interned or hashed, they are only printed,
+    compared and concatenated.
+*/
+struct ObjRope{
+    Obj obj;
+    int length;
+    ObjBuffer*buffer;
 };
 
 struct ObjBoundMethod{
@@ -78,22 +153,51 @@ typedef struct{
 #define AS_CLASS(value) ((ObjClass*)AS_OBJ(value))
 #define AS_INSTANCE(value) ((ObjInstance*)AS_OBJ(value))
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod*)AS_OBJ(value))
+#define AS_ROPE(value) ((ObjRope*)AS_OBJ(value))
 
 
+// number of bytes the object itself takes, not counting the arrays it owns
+size_t objectSize(Obj*obj);
 ObjString* copyString(const char*chars,int length);
-ObjString *allocateString(char *chars,int length,uint32_t hash);
-uint32_t hashString(const char*key,int length);
+// copyString() for chars whose hashString() is already known, like the scanner's tokens
+ObjString* copyHashedString(const char*chars,int length,uint32_t hash);
+// allocates a string with room for length chars that isn't interned, the caller fills them in
+ObjString* allocateString(int length);
+// returns the interned string with the same chars, string itself if there is none yet
+ObjString* internString(ObjString*string);
+// strings built at runtime and ropes aren't interned, comparing pointers doesn't settle their equality
+#define IS_UNINTERNED(value) (IS_ROPE(value) || (IS_STRING(value) && !AS_STRING(value)->isInterned))
 ObjString* tableFindString(Table*table,const char*chars,int length,uint32_t hash);
 ObjFunction* newFunction();
 ObjNative* newNative(NativeFn fn);
 ObjClass* newClass(ObjString*name);
 ObjInstance *newInstance(ObjClass*klass);
 ObjBoundMethod* newBoundMethod(ObjFunction*fn,Value receiver);
+ObjShape* newShape(ObjShape*parent,ObjString*key);
+// returns the slot of the field in instances with this shape, or -1
+int shapeSlot(ObjShape*shape,ObjString*key);
+// returns the shape reached from shape by adding the field key
+ObjShape* shapeTransition(ObjShape*shape,ObjString*key);
+bool instanceGetField(ObjInstance*instance,ObjString*name,Value*value);
+void instanceSetField(ObjInstance*instance,ObjString*name,Value value);
+// stores value in the slot of the field added by the transition from the instance's shape to shape
+void instanceAddField(ObjInstance*instance,ObjShape*shape,Value value);
+// returns the rope holding the chars of a followed by those of b, both are strings or ropes kept on the stack
+ObjRope* concatenateRope(Value a,Value b);
 
 static inline bool isObjType(Value value,ObjType type){
     return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
+// the chars of a string or a rope, a rope's aren't NUL terminated
+static inline const char* stringChars(Value value){
+    return IS_ROPE(value)?AS_ROPE(value)->buffer->chars:AS_STRING(value)->chars;
+}
+
+static inline int stringLength(Value value){
+    return IS_ROPE(value)?AS_ROPE(value)->length:AS_STRING(value)->length;
+}
+
 void printObject(Value value);
 
 #endif 
\ No newline at end of file
@@ -0,0 +1,332 @@
+#include "optimizer.h"
+#include "memory.h"
+#include <string.h>
+
+/*
+    the compiler emits naive sequences, once a function is complete they are rewritten as
+
+        EQUAL NOT                              ->  NOT_EQUAL, same for GREATER NOT and LESSER NOT
+        JUMP_IF_FALSE x POP ... x: POP         ->  POP_JUMP_IF_FALSE to the instruction after x
+        LESSER JUMP_IF_FALSE x POP ... x: POP  ->  JUMP_IF_NOT_LESS to the instruction after x, same for every comparison
+        GET_LOCAL a CONSTANT k ADD SET_LOCAL a POP  ->  ADD_LOCAL_CONST a k, when k is a number
+        POPN 0                                 ->  nothing
+
+    an instruction some jump lands on is never folded into the one before it. Code that can't be reached
+    anymore, like the POP a conditional jump used to land on right after an unconditional jump, is dropped.
+    Every jump is pointed at the new offset of its target once the new code is laid out.
+
+    The compiler emits forward jumps with 24 bit offsets, they get the 16 bit form whenever their distance
+    in the old code fits. The new code is never longer than the old one between a jump and its target,
+    so the distance still fits once the code is laid out.
+*/
+
+// a jump in the new code and the offset in the old code it lands on
+typedef struct{
+    int offset;
+    int target;
+}JumpPatch;
+
+static bool isJump(uint8_t opcode){
+    switch(opcode){
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP:
+        case OP_LOOP:
+        case OP_JUMP_IF_FALSE_LONG:
+        case OP_JUMP_LONG:
+        case OP_LOOP_LONG:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_LESS_EQUAL:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_NOT_GREATER_EQUAL:
+        case OP_JUMP_IF_NOT_EQUAL:
+        case OP_JUMP_IF_EQUAL:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool isLongJump(uint8_t opcode){
+    return opcode == OP_JUMP_LONG || opcode == OP_JUMP_IF_FALSE_LONG || opcode == OP_LOOP_LONG;
+}
+
+static int jumpTarget(Chunk *chunk,int offset){
+    uint8_t *code = &chunk->code[offset];
+    int length = instructionLength(code[0]);
+    int jump = isLongJump(code[0])?code[1] << 16 | code[2] << 8 | code[3]:code[1] << 8 | code[2];
+    if(code[0] == OP_LOOP || code[0] == OP_LOOP_LONG){
+        return offset + length - jump;
+    }
+    return offset + length + jump;
+}
+
+// the jump at offset still lands on target, which may differ from its own target, with a 16 bit offset
+static bool fitsShortJump(Chunk *chunk,int offset,int target){
+    int end = offset + instructionLength(chunk->code[offset]);
+    return (target > end?target - end:end - target) <= UINT16_MAX;
+}
+
+static uint8_t shortJump(uint8_t opcode){
+    switch(opcode){
+        case OP_JUMP_LONG: return OP_JUMP;
+        case OP_JUMP_IF_FALSE_LONG: return OP_JUMP_IF_FALSE;
+        case OP_LOOP_LONG: return OP_LOOP;
+        default: return opcode;
+    }
+}
+
+// comparison computed by a comparison followed by OP_NOT
+static uint8_t negatedComparison(uint8_t comparison){
+    switch(comparison){
+        case OP_EQUAL: return OP_NOT_EQUAL;
+        case OP_GREATER: return OP_LESS_EQUAL;
+        default: return OP_GREATER_EQUAL;
+    }
+}
+
+// branch that jumps when the comparison is false
+static uint8_t branchFor(uint8_t comparison){
+    switch(comparison){
+        case OP_LESSER: return OP_JUMP_IF_NOT_LESS;
+        case OP_LESS_EQUAL: return OP_JUMP_IF_NOT_LESS_EQUAL;
+        case OP_GREATER: return OP_JUMP_IF_NOT_GREATER;
+        case OP_GREATER_EQUAL: return OP_JUMP_IF_NOT_GREATER_EQUAL;
+        case OP_EQUAL: return OP_JUMP_IF_NOT_EQUAL;
+        default: return OP_JUMP_IF_EQUAL;
+    }
+}
+
+void optimizeChunk(Chunk *chunk){
+    int size = chunk->size;
+    uint8_t *code = chunk->code;
+
+    // number of jumps landing on each offset of the old code
+    int *jumpsTo = ALLOCATE(int,size + 1);
+    // offset in the new code of each instruction of the old code
+    int *newOffset = ALLOCATE(int,size + 1);
+    uint8_t *newCode = ALLOCATE(uint8_t,size);
+    int *newLines = ALLOCATE(int,size);
+    JumpPatch *patches = ALLOCATE(JumpPatch,size / 3 + 1);
+    int patchCount = 0;
+    int count = 0;
+
+    memset(jumpsTo,0,sizeof(int) * (size + 1));
+    for(int offset = 0;offset < size;offset += instructionLength(code[offset])){
+        if(isJump(code[offset])){
+            jumpsTo[jumpTarget(chunk,offset)]++;
+        }
+    }
+
+    // the instruction at offset is the given one and can be folded into the instructions before it
+    #define FOLDABLE(offset,opcode) ((offset) < size && code[offset] == (opcode) && jumpsTo[offset] == 0)
+    // the instruction at offset is a conditional jump that can be folded into the instructions before it
+    #define FOLDABLE_JUMP(offset) (FOLDABLE(offset,OP_JUMP_IF_FALSE) || FOLDABLE(offset,OP_JUMP_IF_FALSE_LONG))
+    /*
+        the conditional jump at offset is followed by a POP and lands on one, so it pops on both paths,
+        and it can skip the POP at its target with a 16 bit offset
+    */
+    #define POPS_ON_BOTH_PATHS(offset) (FOLDABLE((offset) + instructionLength(code[offset]),OP_POP)\
+        && jumpTarget(chunk,offset) < size && code[jumpTarget(chunk,offset)] == OP_POP\
+        && fitsShortJump(chunk,offset,jumpTarget(chunk,offset) + 1))
+    #define EMIT(byte) (newCode[count] = (byte),newLines[count++] = line)
+
+    bool reachable = true;
+    int offset = 0;
+    while(offset < size){
+        uint8_t opcode = code[offset];
+        int line = chunk->lines[offset];
+        int next = offset + instructionLength(opcode);
+        newOffset[offset] = count;
+
+        if(jumpsTo[offset] > 0)reachable = true;
+        if(!reachable){
+            if(isJump(opcode) && opcode != OP_LOOP && opcode != OP_LOOP_LONG){
+                jumpsTo[jumpTarget(chunk,offset)]--;
+            }
+            offset = next;
+            continue;
+        }
+
+        if(opcode == OP_GET_LOCAL && FOLDABLE(offset + 2,OP_CONSTANT) && FOLDABLE(offset + 4,OP_ADD)
+            && FOLDABLE(offset + 5,OP_SET_LOCAL) && FOLDABLE(offset + 7,OP_POP)
+            && code[offset + 6] == code[offset + 1] && IS_NUM(chunk->constants.values[code[offset + 3]])){
+            EMIT(OP_ADD_LOCAL_CONST);
+            EMIT(code[offset + 1]);
+            EMIT(code[offset + 3]);
+            next = offset + 8;
+        }
+        else if(opcode == OP_EQUAL || opcode == OP_GREATER || opcode == OP_LESSER){
+            uint8_t comparison = opcode;
+            if(FOLDABLE(next,OP_NOT)){
+                comparison = negatedComparison(opcode);
+                next++;
+            }
+            if(FOLDABLE_JUMP(next) && POPS_ON_BOTH_PATHS(next)){
+                // the branch skips the POP its target used to do
+                int target = jumpTarget(chunk,next);
+                jumpsTo[target]--;
+                jumpsTo[target + 1]++;
+                patches[patchCount++] = (JumpPatch){count,target + 1};
+                EMIT(branchFor(comparison));
+                EMIT(0xff);
+                EMIT(0xff);
+                next += instructionLength(code[next]) + 1;
+            }
+            else{
+                EMIT(comparison);
+            }
+        }
+        else if(opcode == OP_POPN && code[offset + 1] == 0){
+            // empty scopes pop nothing
+        }
+        else if((opcode == OP_JUMP_IF_FALSE || opcode == OP_JUMP_IF_FALSE_LONG) && POPS_ON_BOTH_PATHS(offset)){
+            int target = jumpTarget(chunk,offset);
+            jumpsTo[target]--;
+            jumpsTo[target + 1]++;
+            patches[patchCount++] = (JumpPatch){count,target + 1};
+            EMIT(OP_POP_JUMP_IF_FALSE);
+            EMIT(0xff);
+            EMIT(0xff);
+            next += 1;
+        }
+        else if(isLongJump(opcode) && fitsShortJump(chunk,offset,jumpTarget(chunk,offset))){
+            patches[patchCount++] = (JumpPatch){count,jumpTarget(chunk,offset)};
+            EMIT(shortJump(opcode));
+            EMIT(0xff);
+            EMIT(0xff);
+        }
+        else{
+            if(isJump(opcode)){
+                patches[patchCount++] = (JumpPatch){count,jumpTarget(chunk,offset)};
+            }
+            for(int i = offset;i < next;i++){
+                newCode[count] = code[i];
+                newLines[count++] = chunk->lines[i];
+            }
+        }
+
+        reachable = opcode != OP_JUMP && opcode != OP_LOOP && opcode != OP_JUMP_LONG && opcode != OP_LOOP_LONG
+            && opcode != OP_RETURN;
+        offset = next;
+    }
+    newOffset[size] = count;
+
+    #undef FOLDABLE
+    #undef FOLDABLE_JUMP
+    #undef POPS_ON_BOTH_PATHS
+    #undef EMIT
+
+    for(int i = 0;i < patchCount;i++){
+        int from = patches[i].offset;
+        int end = from + instructionLength(newCode[from]);
+        int target = newOffset[patches[i].target];
+        int jump = newCode[from] == OP_LOOP || newCode[from] == OP_LOOP_LONG?end - target:target - end;
+        if(isLongJump(newCode[from])){
+            newCode[from + 1] = (uint8_t)(jump >> 16);
+            newCode[from + 2] = (uint8_t)(jump >> 8);
+            newCode[from + 3] = (uint8_t)jump;
+        }
+        else{
+            newCode[from + 1] = (uint8_t)(jump >> 8);
+            newCode[from + 2] = (uint8_t)jump;
+        }
+    }
+
+    FREE_ARRAY(uint8_t,chunk->code,chunk->capacity);
+    FREE_ARRAY(int,chunk->lines,chunk->capacity);
+    chunk->code = newCode;
+    chunk->lines = newLines;
+    chunk->capacity = size;
+    chunk->size = count;
+
+    FREE_ARRAY(int,jumpsTo,size + 1);
+    FREE_ARRAY(int,newOffset,size + 1);
+    FREE_ARRAY(JumpPatch,patches,size / 3 + 1);
+}
+
+// change in stack height made by the instruction at offset, a jump leaves the stack the same on both paths
+static int stackEffect(Chunk *chunk,int offset){
+    uint8_t *code = &chunk->code[offset];
+    switch(code[0]){
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_LONG:
+        case OP_GET_LOCAL:
+        case OP_GET_LOCAL_LONG:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_NIL:
+        case OP_CLASS:
+        case OP_CLASS_LONG:
+            return 1;
+        case OP_RETURN:
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_ADD_NUM:
+        case OP_ADD_STR:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESSER:
+        case OP_NOT_EQUAL:
+        case OP_LESS_EQUAL:
+        case OP_GREATER_EQUAL:
+        case OP_PRINT:
+        case OP_POP:
+        case OP_DEFINE_GLOBAL:
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_SET_PROPERTY:
+        case OP_SET_PROPERTY_LONG:
+        case OP_METHOD:
+        case OP_METHOD_LONG:
+        case OP_POP_JUMP_IF_FALSE:
+            return -1;
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_LESS_EQUAL:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_NOT_GREATER_EQUAL:
+        case OP_JUMP_IF_NOT_EQUAL:
+        case OP_JUMP_IF_EQUAL:
+            return -2;
+        case OP_POPN:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+            return -code[1];
+        case OP_INVOKE:
+        case OP_TAIL_INVOKE:
+            return -code[2];
+        case OP_INVOKE_LONG:
+        case OP_TAIL_INVOKE_LONG:
+            return -code[4];
+        default:
+            return 0;
+    }
+}
+
+/*
+    walks the code in order, the height at an instruction some forward jump lands on is the larger of the two
+    paths. Code after an unconditional jump keeps the height it had, that can only overestimate.
+*/
+int maxStackSize(Chunk *chunk,int arity){
+    int *heightAt = ALLOCATE(int,chunk->size + 1);
+    for(int i = 0;i <= chunk->size;i++)heightAt[i] = -1;
+
+    int height = arity + 1;
+    int max = height;
+    for(int offset = 0;offset < chunk->size;offset += instructionLength(chunk->code[offset])){
+        if(heightAt[offset] > height)height = heightAt[offset];
+        if(height > max)max = height;
+        height += stackEffect(chunk,offset);
+        if(height > max)max = height;
+        if(isJump(chunk->code[offset])){
+            int target = jumpTarget(chunk,offset);
+            if(height > heightAt[target])heightAt[target] = height;
+        }
+    }
+
+    FREE_ARRAY(int,heightAt,chunk->size + 1);
+    return max;
+}
\ No newline at end of file
@@ -0,0 +1,13 @@
+#ifndef optimizer_h
+#define optimizer_h
+
+#include "chunk.h"
+
+// peephole pass over the finished chunk of a function, fuses common instruction sequences into superinstructions
+
+void optimizeChunk(Chunk *chunk);
+
+// largest stack height the code of a function with this arity reaches, counting its callee slot and arguments
+int maxStackSize(Chunk *chunk,int arity);
+
+#endif
\ No newline at end of file
@@ -1,5 +1,6 @@
 #include "scanner.h"
 #include "common.h"
+#include "hash.h"
 #include <string.h>
 #include <stdio.h>
 
@@ -25,6 +26,7 @@ Token makeToken(TokenType type){
     token.start = scanner.start;
     token.length = (int)(scanner.current - scanner.start);
     token.line = scanner.line;
+    token.hash = 0;
     return token;
 }
 
@@ -41,6 +43,7 @@ Token errorToken(const char*message){
     token.start = message;
     token.length = (int)strlen(message);
     token.line = scanner.line;
+    token.hash = 0;
     return token;
 }
 
@@ -104,7 +107,10 @@ static Token string(){
 
     if(isAtEnd())return errorToken("Unterminated string");
     advance();
-    return makeToken(TOKEN_STRING);
+    Token token = makeToken(TOKEN_STRING);
+    // hashed while its chars are still in the cache, the compiler interns them without reading them again
+    token.hash = hashString(token.start + 1,token.length - 2);
+    return token;
 }
 
 // checks if the character is a digit
@@ -181,7 +187,9 @@ TokenType identifierType(){
 
 Token identifier(){
     while(isAlpha(peek()) || isDigit(peek()))advance();
-    return makeToken(identifierType());
+    Token token = makeToken(identifierType());
+    token.hash = hashString(token.start,token.length);
+    return token;
 }
 
 // scans one token and returns it
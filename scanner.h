@@ -1,6 +1,8 @@
 #ifndef scanner_h
 #define scanner_h
 
+#include "common.h"
+
 
 // struct for the lexical scanner
 typedef struct{
@@ -48,6 +50,8 @@ typedef struct{
     int length;
     // its line number
     int line;
+    // hashString() of an identifier or keyword, or of a string's chars without the quotes, 0 for other tokens
+    uint32_t hash;
 }Token;
 
 
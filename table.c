@@ -1,5 +1,6 @@
 #include "table.h"
 #include "object.h"
+#include "vm.h"
 #include <stdio.h>
 #include <inttypes.h>
 
@@ -11,27 +12,43 @@ void initTable(Table *table){
 }
 
 void freeTable(Table *table){
-    FREE_ARRAY(Table,table->entries,table->capacity);
+    FREE_ARRAY(Entry,table->entries,table->capacity);
     initTable(table);
 }
 
-Entry*findEntry(ObjString*key,int capacity,Entry*entries){
-    uint32_t bucket = key->hash & (capacity - 1);
-    Entry *tombstone = NULL;
-    for(;;){
-        Entry*entry = &entries[bucket];
+// returns the entry of key, NULL when it isn't in the table
+static Entry* findEntry(Table*table,ObjString*key){
+    if(table->count == 0)return NULL;
+    int mask = table->capacity - 1;
+    int index = key->hash & mask;
+    for(int distance = 0;;distance++){
+        Entry*entry = &table->entries[index];
+        if(entry->key == key)return entry;
+        // key would have taken the place of an entry closer to its bucket
+        if(entry->key == NULL || entryDistance(entry,index,mask) < distance)return NULL;
+        index = (index + 1) & mask;
+    }
+}
+
+// puts a key that isn't in entries yet, it takes the place of the first entry closer to its bucket than
+// the probe is and that entry goes on looking for a slot
+static void insertEntry(Entry*entries,int mask,ObjString*key,Value value,uint32_t hash){
+    Entry carried = {key,value,hash};
+    int index = hash & mask;
+    for(int distance = 0;;distance++){
+        Entry*entry = &entries[index];
         if(entry->key == NULL){
-           if(IS_NIL(entry->value)){
-              return tombstone != NULL?tombstone:entry;
-           }
-           else{
-               if(tombstone == NULL)tombstone = entry;
-           }
+            *entry = carried;
+            return;
         }
-        else if(entry->key == key){
-            return entry;
+        int entryAt = entryDistance(entry,index,mask);
+        if(entryAt < distance){
+            Entry displaced = *entry;
+            *entry = carried;
+            carried = displaced;
+            distance = entryAt;
         }
-        bucket = (bucket + 1) & (capacity - 1);
+        index = (index + 1) & mask;
     }
 }
 
@@ -41,56 +58,74 @@ void growCapacity(Table*table,int capacity){
         entries[i].key = NULL;
         entries[i].value = NIL_VAL;
     }
-    
-    table->count = 0;
 
     for(int i = 0;i < table->capacity;i++){
         Entry*entry = &table->entries[i];
         if(entry->key == NULL)continue;
-        Entry*dest = findEntry(entry->key,capacity,entries);
-        dest->key = entry->key;
-        dest->value = entry->value;
-        table->count++;
+        insertEntry(entries,capacity - 1,entry->key,entry->value,entry->hash);
     }
-    FREE_ARRAY(Entry,table->entries,capacity);
+    // the marker thread may be reading the old entries
+    lockHeap();
+    Entry*oldEntries = table->entries;
+    int oldCapacity = table->capacity;
     table->entries = entries;
     table->capacity = capacity;
+    unlockHeap();
+    FREE_ARRAY(Entry,oldEntries,oldCapacity);
 }
 
 bool tableSet(Table*table,ObjString*key,Value value){
+    Entry*entry = findEntry(table,key);
+    if(entry != NULL){
+        SHADE(entry->value);
+        entry->value = value;
+        return false;
+    }
 
     if(table->count + 1 > table->capacity * TABLE_MAX_LOAD){
         int capacity = GROW_CAPACITY(table->capacity);
         growCapacity(table,capacity);
     }
-
-    Entry*entry = findEntry(key,table->capacity,table->entries);
-    bool isNewKey = (entry->key == NULL);
-    if(isNewKey && IS_NIL(entry->value))table->count++;
-    entry->key = key;
-    entry->value = value;
-    return isNewKey;
+    // entries are moved along the probe, the marker thread must not see one while it's carried
+    lockHeap();
+    insertEntry(table->entries,table->capacity - 1,key,value,key->hash);
+    unlockHeap();
+    table->count++;
+    return true;
 }
 
 bool tableGet(Table*table,ObjString*key,Value *value){
-    if(table->count == 0)return false;
-    Entry*entry = findEntry(key,table->capacity,table->entries);
-    if(entry->key == NULL)return false;
+    Entry*entry = findEntry(table,key);
+    if(entry == NULL)return false;
     *value = entry->value;
     return true;
 }
 
-
 bool tableDelete(Table*table,ObjString*key){
-    if(table->count == 0)return false;
-    Entry*entry = findEntry(key,table->capacity,table->entries);
-    if(entry->key == NULL)return false;
+    Entry*entry = findEntry(table,key);
+    if(entry == NULL)return false;
 
-    entry->key = NULL;
-    entry->value = BOOL_VAL(true);
+    // the entries up to the next empty one or the next one in its own bucket move a slot closer to theirs
+    int mask = table->capacity - 1;
+    int index = (int)(entry - table->entries);
+    for(;;){
+        int next = (index + 1) & mask;
+        Entry*following = &table->entries[next];
+        if(following->key == NULL || entryDistance(following,next,mask) == 0)break;
+        table->entries[index] = *following;
+        index = next;
+    }
+    table->entries[index].key = NULL;
+    table->entries[index].value = NIL_VAL;
+    table->count--;
     return true;
 }
 
+void tableRekey(Table*table,ObjString*key,ObjString*newKey){
+    Entry*entry = findEntry(table,key);
+    if(entry != NULL)entry->key = newKey;
+}
+
 void tableCopy(Table*from,Table*to){
     for(int i = 0;i < from->capacity;i++){
         Entry*entry = &from->entries[i];
@@ -5,9 +5,16 @@
 #include "common.h"
 #include "value.h"
 
+/*
+    open addressing with robin hood probing: an entry never sits further from its bucket than the ones it passed,
+    so a lookup stops at the first entry closer to its own bucket than the probe is. Deleting shifts the entries
+    that follow back a slot, there are no tombstones. An empty entry has a NULL key.
+*/
 typedef struct{
     ObjString* key;
     Value value;
+    // the key's hash, probing never has to read the key itself
+    uint32_t hash;
 }Entry;
 
 
@@ -17,11 +24,19 @@ typedef struct{
     Entry *entries;
 }Table;
 
+// how many slots past its bucket the entry at index sits, mask is the capacity minus 1
+static inline int entryDistance(Entry*entry,int index,int mask){
+    return (index - (int)(entry->hash & mask)) & mask;
+}
+
 
 void initTable(Table *table);
 void freeTable(Table *table);
 bool tableSet(Table*table,ObjString*key,Value value);
 bool tableGet(Table*table,ObjString*key,Value *value);
+// the entries after the deleted one move back, the marker thread must not be reading the table
 bool tableDelete(Table*table,ObjString*key);
+// points the entry of key at newKey, an object with the same hash that replaced it
+void tableRekey(Table*table,ObjString*key,ObjString*newKey);
 
 #endif
\ No newline at end of file
@@ -15,7 +15,7 @@ void writeValueArray(ValueArray*array,Value value){
     if(array->size == array->capacity){
         int oldCapacity = array->capacity;
         array->capacity = GROW_CAPACITY(oldCapacity);
-        array->values = GROW_ARRAY(Value,array->values,oldCapacity,array->capacity);
+        GROW_SHARED_ARRAY(Value,array->values,oldCapacity,array->capacity);
     }
     array->values[array->size] = value;
     array->size++;
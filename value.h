@@ -9,6 +9,9 @@ typedef struct ObjFunction ObjFunction;
 typedef struct ObjClass ObjClass;
 typedef struct ObjInstance ObjInstance;
 typedef struct ObjBoundMethod ObjBoundMethod;
+typedef struct ObjShape ObjShape;
+typedef struct ObjBuffer ObjBuffer;
+typedef struct ObjRope ObjRope;
 
 #ifdef NAN_BOXING
 
@@ -19,6 +22,7 @@ typedef uint64_t Value;
 #define TAG_NIL 1 
 #define TAG_FALSE 2
 #define TAG_TRUE 3
+#define TAG_UNDEFINED 4
 
 static Value numToValue(double num){
     Value value;
@@ -39,6 +43,10 @@ static double valueToNum(Value value){
 #define NIL_VAL  ((Value)(uint64_t)(TAG_NIL | QNAN))
 #define IS_NIL(val) (val == NIL_VAL)
 
+// marks global variables that have a slot but were not defined yet, never seen by lox code
+#define UNDEFINED_VAL ((Value)(uint64_t)(TAG_UNDEFINED | QNAN))
+#define IS_UNDEFINED(val) ((val) == UNDEFINED_VAL)
+
 #define FALSE_VAL ((Value)(uint64_t)(TAG_FALSE | QNAN))
 #define TRUE_VAL ((Value)(uint64_t)(TAG_TRUE | QNAN))
 #define BOOL_VAL(val) ((val) ? TRUE_VAL : FALSE_VAL)
@@ -56,6 +64,7 @@ typedef enum{
     VAL_BOOL,
     VAL_NIL,
     VAL_OBJ,
+    VAL_UNDEFINED,
 }ValueType;
 
 typedef struct {
@@ -72,6 +81,8 @@ typedef struct {
 #define BOOL_VAL(val) ((Value){VAL_BOOL,{.boolean = val}})
 #define NIL_VAL  ((Value){VAL_NIL,{.number = 0}})
 #define OBJ_VAL(val) ((Value){VAL_OBJ,{.obj = (Obj*)(val)}})
+// marks global variables that have a slot but were not defined yet, never seen by lox code
+#define UNDEFINED_VAL ((Value){VAL_UNDEFINED,{.number = 0}})
 
 #define AS_NUM(val) ((val).as.number)
 #define AS_BOOL(val) ((val).as.boolean)
@@ -81,6 +92,7 @@ typedef struct {
 #define IS_NUM(val) ((val).type == VAL_NUM)
 #define IS_NIL(val) ((val).type == VAL_NIL)
 #define IS_OBJ(val) ((val).type == VAL_OBJ)
+#define IS_UNDEFINED(val) ((val).type == VAL_UNDEFINED)
 
 #endif
 
@@ -8,10 +8,41 @@
 #include "object.h"
 #include <inttypes.h>
 #include <stdlib.h>
+#include "allocator.h"
 #include <time.h>
+#include <setjmp.h>
 
 VM vm;
 
+// where outOfMemory() unwinds to, only while interpret() runs
+static jmp_buf errorJump;
+static bool canUnwind = false;
+
+/*
+    the stack and the frames are allocated through reallocate() so they count against --gc-max-heap, growing them
+    may run the collector (which never moves objects outside of a safe point) or raise the out of memory error.
+    Growing the stack moves it, so the stack top and the slots of every frame are rebased onto the new array,
+    run() reloads its frame pointer after each call.
+*/
+static void growStack(int needed){
+    int capacity = vm.stackCapacity;
+    while(capacity < needed)capacity *= 2;
+    Value*stack = GROW_ARRAY(Value,vm.stack,vm.stackCapacity,capacity);
+    for(int i = 0;i < vm.frameCount;i++){
+        vm.frames[i].slots = stack + (vm.frames[i].slots - vm.stack);
+    }
+    vm.stackTop = stack + (vm.stackTop - vm.stack);
+    vm.stack = stack;
+    vm.stackCapacity = capacity;
+}
+
+static void growFrames(){
+    int capacity = vm.frameCapacity * 2;
+    if(capacity > vm.maxFrames)capacity = vm.maxFrames;
+    vm.frames = GROW_ARRAY(CallFrame,vm.frames,vm.frameCapacity,capacity);
+    vm.frameCapacity = capacity;
+}
+
 // points the stack top pointer to the beginning of the stack array
 void resetStack(){
     vm.stackTop = vm.stack;
@@ -23,28 +54,122 @@ Value clockNative(int argCount,Value *args){
     return NUM_VAL((double)clock()/CLOCKS_PER_SEC);
 }
 
+// sets a numeric field of the instance gcStats() returns
+static void setStat(ObjInstance*stats,const char*name,double value){
+    push(OBJ_VAL(copyString(name,(int)strlen(name))));
+    instanceSetField(stats,AS_STRING(vm.stackTop[-1]),NUM_VAL(value));
+    pop();
+}
+
+/*
+    returns a GcStats instance with what the collector did so far, pauses in milliseconds, and the bytes the
+    objects of each type take in the heap now. Those are heap bytes, not live bytes: every old object the sweep
+    hasn't freed and the whole nursery are counted, garbage included, so the heap* fields are named after that.
+*/
+Value gcStatsNative(int argCount,Value *args){
+    size_t heapBytes[OBJ_TYPE_COUNT];
+    countHeapBytes(heapBytes);
+    ObjInstance*stats = newInstance(vm.gcStatsClass);
+    push(OBJ_VAL(stats));
+    setStat(stats,"collections",vm.gcStats.cycles);
+    setStat(stats,"minorCollections",vm.gcStats.minorCollections);
+    setStat(stats,"pauseTotal",vm.gcStats.pauseTotal / 1000);
+    setStat(stats,"pauseMax",vm.gcStats.pauseMax / 1000);
+    setStat(stats,"bytesFreed",(double)vm.gcStats.bytesFreed);
+    setStat(stats,"bytesAllocated",(double)vm.bytesAllocated);
+    setStat(stats,"nextGC",(double)vm.nextGC);
+    setStat(stats,"heapStrings",(double)heapBytes[OBJ_STR]);
+    setStat(stats,"heapFunctions",(double)heapBytes[OBJ_FUNCTION]);
+    setStat(stats,"heapNatives",(double)heapBytes[OBJ_NATIVE]);
+    setStat(stats,"heapClasses",(double)heapBytes[OBJ_CLASS]);
+    setStat(stats,"heapInstances",(double)heapBytes[OBJ_INSTANCE]);
+    setStat(stats,"heapBoundMethods",(double)heapBytes[OBJ_BOUND_METHOD]);
+    setStat(stats,"heapShapes",(double)heapBytes[OBJ_SHAPE]);
+    setStat(stats,"heapBuffers",(double)heapBytes[OBJ_BUFFER]);
+    setStat(stats,"heapRopes",(double)heapBytes[OBJ_ROPE]);
+    pop();
+    return OBJ_VAL(stats);
+}
+
+int globalSlot(ObjString*name){
+    Value slot;
+    if(tableGet(&vm.globalSlots,name,&slot)){
+        return (int)AS_NUM(slot);
+    }
+    push(OBJ_VAL(name));
+    writeValueArray(&vm.globalValues,UNDEFINED_VAL);
+    writeValueArray(&vm.globalNames,OBJ_VAL(name));
+    tableSet(&vm.globalSlots,name,NUM_VAL(vm.globalNames.size - 1));
+    pop();
+    return vm.globalNames.size - 1;
+}
+
 void defineNative(const char*name,NativeFn function){
     push(OBJ_VAL(copyString(name,(int)strlen(name))));
     push(OBJ_VAL(newNative(function)));
-    tableSet(&vm.globals,AS_STRING(vm.stack[0]),vm.stack[1]);
+    int slot = globalSlot(AS_STRING(vm.stack[0]));
+    vm.globalValues.values[slot] = vm.stack[1];
     pop();
     pop();
 }
 
 
 void initVM(){
-    resetStack();
-    vm.objects = NULL;
-    initTable(&vm.strings);
-    initTable(&vm.globals);
-    defineNative("clock",clockNative);
+    vm.nursery = (uint8_t*)malloc(NURSERY_SIZE);
+    vm.nurseryMarks = (uint64_t*)calloc(NURSERY_MARK_WORDS,sizeof(uint64_t));
+    if(vm.nursery == NULL || vm.nurseryMarks == NULL)exit(1);
+    vm.maxFrames = FRAME_MAX;
+    vm.nurseryTop = vm.nursery;
+    vm.nurseryFull = false;
+    vm.collectingNursery = false;
+    vm.remembered = NULL;
+    vm.rememberedCount = 0;
+    vm.rememberedCapacity = 0;
+    vm.youngStrings = NULL;
+    vm.youngStringCount = 0;
+    vm.youngStringCapacity = 0;
+    vm.gcState = GC_IDLE;
+    vm.gcPause = GC_PAUSE_DEFAULT;
+    vm.gcDebt = 0;
+    vm.gcConcurrent = false;
+    vm.markerRunning = false;
+    vm.gcSweepThreads = 0;
+    vm.sweepersRunning = false;
+    vm.gcCompact = false;
+    vm.compactPending = false;
+    vm.gcGrowth = GC_GROW_RATE;
+    vm.gcMaxHeap = 0;
+    vm.gcMinInterval = 0;
+    vm.gcLog = false;
+    memset(&vm.gcStats,0,sizeof(vm.gcStats));
     vm.grayStack = NULL;
     vm.grayCount = 0;
     vm.grayCapacity = 0;
     vm.bytesAllocated = 0;
-    vm.nextGC = 1024 * 1024;
+    vm.nextGC = GC_INITIAL_HEAP;
+    // allocated once the collector is set up, they count as heap memory
+    vm.stack = ALLOCATE(Value,STACK_INITIAL);
+    vm.stackCapacity = STACK_INITIAL;
+    vm.frames = ALLOCATE(CallFrame,FRAMES_INITIAL);
+    vm.frameCapacity = FRAMES_INITIAL;
+    resetStack();
+    initTable(&vm.strings);
+    initTable(&vm.globalSlots);
+    initValueArray(&vm.globalValues);
+    initValueArray(&vm.globalNames);
+    defineNative("clock",clockNative);
+    defineNative("gcStats",gcStatsNative);
     vm.initString = NULL;
     vm.initString = copyString("init",4);
+    vm.gcStatsClass = NULL;
+    push(OBJ_VAL(copyString("GcStats",7)));
+    vm.gcStatsClass = newClass(AS_STRING(vm.stackTop[-1]));
+    pop();
+    vm.traceExecution = false;
+    vm.traceOpsOnly = false;
+    memset(vm.traceOps,0,sizeof(vm.traceOps));
+    vm.traceFunction = NULL;
+    vm.printCode = false;
 }
 
 void push(Value value){
@@ -61,60 +186,87 @@ static Value peek(int distance){
     return vm.stackTop[-1 - distance];
 }
 
-void freeObject(Obj*obj){
-    #ifdef GC_LOG
-    printf("freed %p of type %d\n",obj,obj->type);
-    #endif
+void freeObjectContents(Obj*obj){
     switch(obj->type){
-        case OBJ_STR:
-            ObjString*string = (ObjString*)obj;
-            FREE_ARRAY(char,string->chars,string->length + 1);
-            FREE(ObjString,string);
-            break;
         case OBJ_FUNCTION:
             ObjFunction*function = (ObjFunction*)obj;
             freeChunk(&function->chunk);
-            FREE(ObjFunction,function);
-            break;
-        case OBJ_NATIVE:
-            ObjNative*native = (ObjNative*)(obj);
-            FREE(ObjNative,native);
             break;
         case OBJ_CLASS:
             ObjClass*klass = (ObjClass*)(obj);
             freeTable(&klass->methods);
-            FREE(ObjClass,klass);
             break;
         case OBJ_INSTANCE:
             ObjInstance *instance = (ObjInstance*)(obj);
-            freeTable(&instance->fields);
-            FREE(ObjInstance,instance);
+            if(instance->fields != instance->inlineFields){
+                FREE_ARRAY(Value,instance->fields,instance->fieldCapacity);
+            }
+            if(instance->dictionary != NULL){
+                freeTable(instance->dictionary);
+                FREE(Table,instance->dictionary);
+            }
             break;
-        case OBJ_BOUND_METHOD:
-            ObjBoundMethod* method = (ObjBoundMethod*)(obj);
-            FREE(ObjBoundMethod,method);
+        case OBJ_SHAPE:
+            ObjShape* shape = (ObjShape*)(obj);
+            freeTable(&shape->transitions);
+            break;
+        case OBJ_BUFFER:
+            ObjBuffer*buffer = (ObjBuffer*)obj;
+            FREE_ARRAY(char,buffer->chars,buffer->capacity);
             break;
         default:
             return;
     }
 }
 
-void freeObjects(Obj*objects){
-    Obj*obj = objects;
-    while(obj != NULL){
-       Obj*next = obj->next;
-       freeObject(obj);
-       obj = next;
+void freeObject(Obj*obj){
+    #ifdef GC_LOG
+    printf("freed %p of type %d\n",obj,obj->type);
+    #endif
+    freeObjectContents(obj);
+    freeOld(obj,objectSize(obj));
+}
+
+// frees what every old object owns, freePages() returns the pages themselves
+void freeObjects(){
+    for(Page*page = objectPages();page != NULL;page = page->next){
+        for(int i = 0;i < PAGE_BITMAP_WORDS;i++){
+            for(uint64_t live = page->live[i];live != 0;live &= live - 1){
+                freeObjectContents((Obj*)PAGE_BLOCK(page,i,__builtin_ctzll(live)));
+            }
+        }
     }
    if(vm.grayStack != NULL)free(vm.grayStack);
 
 }
 
+// frees what the objects left in the nursery own, then the nursery itself
+static void freeNursery(){
+    for(uint8_t*top = vm.nursery;top < vm.nurseryTop;){
+        Obj*object = (Obj*)top;
+        top += objectSize(object);
+        freeObjectContents(object);
+    }
+    free(vm.nursery);
+    free(vm.nurseryMarks);
+    free(vm.remembered);
+    free(vm.youngStrings);
+}
+
 void freeVM(){
+    if(vm.markerRunning)stopMarker();
+    if(vm.sweepersRunning)stopSweepers();
     vm.initString = NULL;
-    freeObjects(vm.objects);
+    vm.gcStatsClass = NULL;
+    freeObjects();
+    freeNursery();
     freeTable(&vm.strings);
-    freeTable(&vm.globals);
+    freeTable(&vm.globalSlots);
+    freeValueArray(&vm.globalValues);
+    freeValueArray(&vm.globalNames);
+    FREE_ARRAY(Value,vm.stack,vm.stackCapacity);
+    FREE_ARRAY(CallFrame,vm.frames,vm.frameCapacity);
+    freePages();
 }
 
 void runtimeError(const char *format,...){
@@ -125,6 +277,12 @@ void runtimeError(const char *format,...){
     fputs("\n",stderr);
 
     for(int i = vm.frameCount - 1;i >= 0;i--){
+        // deep recursion only shows the innermost and outermost frames
+        if(i == vm.frameCount - 1 - TRACE_FRAMES && i > TRACE_FRAMES){
+            fprintf(stderr,"[... %d more frames]\n",i + 1 - TRACE_FRAMES);
+            i = TRACE_FRAMES;
+            continue;
+        }
         CallFrame *frame = &vm.frames[i];
         size_t instruction = frame->ip - frame->function->chunk.code - 1;
         int line = frame->function->chunk.lines[instruction];
@@ -135,6 +293,9 @@ void runtimeError(const char *format,...){
         else{
             fprintf(stderr,"%s()\n",frame->function->name->chars);
         }
+        if(frame->elided > 0){
+            fprintf(stderr,"[... %d frame%s elided by tail calls]\n",frame->elided,frame->elided == 1?"":"s");
+        }
     }
     
     resetStack();
@@ -144,10 +305,15 @@ bool isFalsey(Value value){
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
+static bool sameChars(Value a,Value b){
+    if(!IS_ANY_STRING(a) || !IS_ANY_STRING(b) || stringLength(a) != stringLength(b))return false;
+    return memcmp(stringChars(a),stringChars(b),stringLength(a)) == 0;
+}
+
 bool areEqual(Value a,Value b){
 
     #ifdef NAN_BOXING
-    return a == b;    
+    if(a == b)return true;
     #else
     if(a.type != b.type)return false;
     switch(a.type){
@@ -158,33 +324,30 @@ bool areEqual(Value a,Value b){
         case VAL_NIL:
             return true;
         case VAL_OBJ:
-             return AS_OBJ(a) == AS_OBJ(b);
+            if(AS_OBJ(a) == AS_OBJ(b))return true;
+            break;
         default:
             return false;
     }
 
     #endif
-}
-
-ObjString* takeString(char *chars,int length){
-    uint32_t hash = hashString(chars,length);
-    ObjString *interned = tableFindString(&vm.strings,chars,length,hash);
-    if(interned != NULL){
-        FREE_ARRAY(char,chars,length + 1);
-        return interned;
-    }
-    return allocateString(chars,length,hash);
+    return (IS_UNINTERNED(a) || IS_UNINTERNED(b)) && sameChars(a,b);
 }
 
 void concatenate(){
-    ObjString * b = AS_STRING(peek(0));
-    ObjString * a = AS_STRING(peek(1));
-    int length = a->length + b->length;
-    char*chars = ALLOCATE(char,length + 1);
-    memcpy(chars,a->chars,a->length);
-    memcpy(chars + a->length,b->chars,b->length);
-    chars[length] = '\0';
-    ObjString*result = takeString(chars,length);
+    Value b = peek(0);
+    Value a = peek(1);
+    int length = stringLength(a) + stringLength(b);
+    Obj*result;
+    if(length >= ROPE_MIN){
+        result = (Obj*)concatenateRope(a,b);
+    }
+    else{
+        ObjString*string = allocateString(length);
+        memcpy(string->chars,stringChars(a),stringLength(a));
+        memcpy(string->chars + stringLength(a),stringChars(b),stringLength(b));
+        result = (Obj*)string;
+    }
     pop();
     pop();
     push(OBJ_VAL(result));
@@ -196,18 +359,37 @@ static bool call(ObjFunction *function,uint8_t argCount){
         return false;
     }
 
-    if(vm.frameCount == FRAME_MAX){
+    if(vm.frameCount == vm.maxFrames){
         runtimeError("stack overflow");
         return false;
     }
+    if(vm.frameCount == vm.frameCapacity)growFrames();
+    // the function's locals and temporaries start at its callee slot
+    int base = (int)(vm.stackTop - vm.stack) - argCount - 1;
+    int needed = base + function->maxStack + STACK_HEADROOM;
+    if(needed > vm.stackCapacity)growStack(needed);
 
     CallFrame*frame = &vm.frames[vm.frameCount++];
     frame->function = function;
     frame->ip = function->chunk.code;
     frame->slots = vm.stackTop - argCount - 1;
+    frame->elided = 0;
     return true;
 }
 
+// the frame a tail call just pushed takes the place of its caller, the callee's slots move down to the caller's
+static void replaceCallerFrame(){
+    CallFrame*callee = &vm.frames[vm.frameCount - 1];
+    CallFrame*caller = &vm.frames[vm.frameCount - 2];
+    int count = (int)(vm.stackTop - callee->slots);
+    memmove(caller->slots,callee->slots,sizeof(Value) * count);
+    vm.stackTop = caller->slots + count;
+    caller->function = callee->function;
+    caller->ip = callee->ip;
+    caller->elided++;
+    vm.frameCount--;
+}
+
 
 bool callValue(Value callee ,uint8_t argCount){
     if(IS_OBJ(callee)){
@@ -216,6 +398,8 @@ bool callValue(Value callee ,uint8_t argCount){
                 return call(AS_FUNCTION(callee),argCount);
             case OBJ_NATIVE:
                 NativeFn native = AS_NATIVE_FN(callee);
+                int needed = (int)(vm.stackTop - vm.stack) + STACK_HEADROOM;
+                if(needed > vm.stackCapacity)growStack(needed);
                 Value result = native(argCount,vm.stackTop - argCount);
                 vm.stackTop -= argCount + 1;
                 push(result);
@@ -235,8 +419,7 @@ bool callValue(Value callee ,uint8_t argCount){
             case OBJ_BOUND_METHOD:
                 ObjBoundMethod *boundMethod = AS_BOUND_METHOD(callee);
                 vm.stackTop[-1 - argCount] = boundMethod->receiver;
-                call(boundMethod->method,argCount);
-                return true;
+                return call(boundMethod->method,argCount);
             default:
                 break;
         }
@@ -245,27 +428,90 @@ bool callValue(Value callee ,uint8_t argCount){
     return false;
 }
 
-bool bindMethod(ObjClass*klass,ObjString*name){
+// returns the entry of the cache for receivers with this shape, NULL if it has none
+static inline CacheEntry* findCacheEntry(InlineCache*cache,ObjShape*shape){
+    for(int i = 0;i < cache->count;i++){
+        if(cache->entries[i].shape == shape)return &cache->entries[i];
+    }
+    return NULL;
+}
+
+// remembers what a name resolved to for receivers with this shape
+static void updateCache(InlineCache*cache,ObjShape*shape,int slot,ObjShape*transition,ObjFunction*method){
+    if(cache->megamorphic || shape == NULL)return;
+    CacheEntry*entry = findCacheEntry(cache,shape);
+    if(entry == NULL){
+        if(cache->count == CACHE_MAX_ENTRIES){
+            cache->megamorphic = true;
+            return;
+        }
+        entry = &cache->entries[cache->count];
+        entry->shape = shape;
+    }
+    else{
+        SHADE_OBJ(entry->transition);
+        SHADE_OBJ(entry->method);
+    }
+    // the cache belongs to the function running in the top frame
+    Obj*owner = (Obj*)vm.frames[vm.frameCount - 1].function;
+    WRITE_BARRIER_OBJ(owner,shape);
+    WRITE_BARRIER_OBJ(owner,transition);
+    WRITE_BARRIER_OBJ(owner,method);
+    entry->slot = slot;
+    entry->transition = transition;
+    entry->method = method;
+    // a new entry only counts once it is filled in, the marker thread may be reading the cache
+    if(entry == &cache->entries[cache->count])cache->count++;
+}
+
+// full lookup of a property of the instance on top of the stack, replaces it with the field or a bound method
+bool getProperty(ObjInstance*instance,ObjString*name,InlineCache*cache){
     Value value;
-    if(!tableGet(&klass->methods,name,&value)){
+    if(instanceGetField(instance,name,&value)){
+        if(instance->shape != NULL){
+            updateCache(cache,instance->shape,shapeSlot(instance->shape,name),NULL,NULL);
+        }
+        pop();
+        push(value);
+        return true;
+    }
+
+    Value method;
+    if(!tableGet(&instance->klass->methods,name,&method)){
+        runtimeError("Undefined method or field");
         return false;
     }
-    ObjBoundMethod*boundMethod = newBoundMethod(AS_FUNCTION(value),peek(0));
+    updateCache(cache,instance->shape,0,NULL,AS_FUNCTION(method));
+    ObjBoundMethod*boundMethod = newBoundMethod(AS_FUNCTION(method),peek(0));
     pop();
     push(OBJ_VAL(boundMethod));
     return true;
 }
 
-bool invokeFromClass(ObjClass*klass,ObjString*name,uint8_t argCount){
+// full store of the value on top of the stack into a field of the instance
+void setProperty(ObjInstance*instance,ObjString*name,InlineCache*cache){
+    ObjShape*shape = instance->shape;
+    instanceSetField(instance,name,peek(0));
+    if(shape == NULL || instance->shape == NULL)return;
+    if(instance->shape == shape){
+        updateCache(cache,shape,shapeSlot(shape,name),NULL,NULL);
+    }
+    else{
+        updateCache(cache,shape,instance->shape->fieldCount - 1,instance->shape,NULL);
+    }
+}
+
+bool invokeFromClass(ObjInstance*instance,ObjString*name,uint8_t argCount,InlineCache*cache){
     Value method;
-    if(!tableGet(&klass->methods,name,&method)){
+    if(!tableGet(&instance->klass->methods,name,&method)){
         runtimeError("No such method %s",name->chars);
         return false;
     }
+    updateCache(cache,instance->shape,0,NULL,AS_FUNCTION(method));
     return call(AS_FUNCTION(method),argCount);
 }
 
-bool invokeMethod(ObjString*name,uint8_t argCount){
+bool invokeMethod(ObjString*name,uint8_t argCount,InlineCache*cache){
     Value receiver = peek(argCount);
     if(!IS_INSTANCE(receiver)){
         runtimeError("Only class instances can call methods");
@@ -274,12 +520,43 @@ bool invokeMethod(ObjString*name,uint8_t argCount){
     ObjInstance*instance = AS_INSTANCE(receiver);
 
     Value value;
-    if(tableGet(&instance->fields,name,&value)){
+    if(instanceGetField(instance,name,&value)){
         vm.stackTop[-1 - argCount] = value;
         return callValue(value,argCount);
     }
 
-    return invokeFromClass(instance->klass,name,argCount);
+    return invokeFromClass(instance,name,argCount,cache);
+}
+
+// calls the method the cache has for the receiver's shape, falls back to a full lookup
+static inline bool invoke(ObjString*name,uint8_t argCount,InlineCache*cache){
+    Value receiver = peek(argCount);
+    CacheEntry*entry = NULL;
+    if(IS_INSTANCE(receiver)){
+        entry = findCacheEntry(cache,AS_INSTANCE(receiver)->shape);
+        if(entry != NULL && entry->method == NULL)entry = NULL;
+    }
+    if(entry != NULL){
+        return call(entry->method,argCount);
+    }
+    return invokeMethod(name,argCount,cache);
+}
+
+// prints the contents of the stack and the instruction about to be executed
+static void traceInstruction(CallFrame*frame){
+    if(vm.traceOpsOnly && !vm.traceOps[*frame->ip])return;
+    if(vm.traceFunction != NULL){
+        const char*name = frame->function->name == NULL?"main":frame->function->name->chars;
+        if(strcmp(name,vm.traceFunction) != 0)return;
+    }
+    printf("              ");
+    for(Value *slot = vm.stack;slot < vm.stackTop;slot++){
+        printf("[");
+        printValue(*slot);
+        printf("]");
+    }
+    printf("\n");
+    disAssembleInstruction(&frame->function->chunk,(int)(frame->ip - frame->function->chunk.code));
 }
 
 InterpretResult run(){
@@ -294,6 +571,14 @@ InterpretResult run(){
     #define READ_STRING() AS_STRING(READ_CONSTANT())
     // combines two 8 bit operands as a single 16 bit number
     #define READ_SHORT() (frame->ip += 2,(uint16_t)(frame->ip[-2] << 8 | frame->ip[-1]))
+    // returns the inline cache whose index is the next operand, 24 bits wide after the name of a _LONG variant
+    #define READ_CACHE(isLong) (&frame->function->chunk.caches[(isLong)?READ_LONG():READ_SHORT()])
+    // combines three 8 bit operands as a single 24 bit number
+    #define READ_LONG() (frame->ip += 3,(uint32_t)(frame->ip[-3] << 16 | frame->ip[-2] << 8 | frame->ip[-1]))
+    // reads the constant index or global slot of a handler shared by an instruction and its _LONG variant
+    #define READ_INDEX(longOp) (frame->ip[-1] == (longOp)?READ_LONG():READ_BYTE())
+    // returns the string constant whose index is the next operand, for handlers shared with a _LONG variant
+    #define READ_NAME(longOp) AS_STRING(frame->function->chunk.constants.values[READ_INDEX(longOp)])
 
     // defines binary operations which involves the top 2 values of the stack
     #define BINARY_OP(valueType,op)\
@@ -307,24 +592,159 @@ InterpretResult run(){
             push(valueType(a op b));\
         }while(false)
 
-    // printing the contents of the stack and the current bytecode
+    // pushes the result of a comparison of the top 2 numbers on the stack, cond is written in terms of a and b
+    #define COMPARE_OP(cond)\
+        do{\
+            if(!IS_NUM(peek(0)) || !IS_NUM(peek(1))){\
+                runtimeError("Operands should be numbers");\
+                return INTERPRET_RUNTIME_ERROR;\
+            }\
+            double b = AS_NUM(pop());\
+            double a = AS_NUM(pop());\
+            push(BOOL_VAL(cond));\
+        }while(false)
+
+    // pops the top 2 numbers on the stack and jumps by the 16 bit operand if cond holds for them
+    #define BRANCH_OP(cond)\
+        do{\
+            uint16_t offset = READ_SHORT();\
+            if(!IS_NUM(peek(0)) || !IS_NUM(peek(1))){\
+                runtimeError("Operands should be numbers");\
+                return INTERPRET_RUNTIME_ERROR;\
+            }\
+            double b = AS_NUM(pop());\
+            double a = AS_NUM(pop());\
+            if(cond)frame->ip += offset;\
+        }while(false)
+
+    /*
+        quickening: a generic instruction that sees the types of its operands rewrites its opcode into a
+        variant specialized for them, the variant only guards that the types still hold. When they don't
+        it puts the generic opcode back and runs it, which specializes again for the new types.
+        Both only work for instructions without operands.
+    */
+    #define QUICKEN(op) (frame->ip[-1] = (op))
+    #define DESPECIALIZE(op) {frame->ip[-1] = (op);frame->ip--;DISPATCH();}
+    /*
+        collects the nursery once it is full. Only placed where no C local holds an object, at backward jumps
+        and before calls, so every loop and every recursion reaches one.
+    */
+    #ifdef GC_STRESS
+    #define SAFEPOINT() if(vm.nurseryTop != vm.nursery || vm.nurseryFull)collectNursery()
+    #else
+    #define SAFEPOINT() if(vm.nurseryFull)collectNursery()
+    #endif
+
+    /*
+        with THREADED_DISPATCH every handler ends by jumping straight to the handler of the next
+        opcode through dispatchTable, so each opcode gets its own indirect branch instead of all of
+        them sharing the single one of the switch. The switch is still the entry point for the
+        portable build and both modes share the same handlers.
+
+        Tracing costs nothing while it is off: in threaded mode dispatchTable is filled with the
+        handlers, or with LABEL_TRACE for every opcode while tracing, so the handlers never check
+        for it. The switch loop pays a single predictable branch per instruction.
+    */
+    #ifdef THREADED_DISPATCH
+        // the range default is overridden by each opcode's handler on purpose, -Wextra would warn about every one
+        #pragma GCC diagnostic push
+        #pragma GCC diagnostic ignored "-Woverride-init"
+        static void* const handlers[UINT8_MAX + 1] = {
+            [0 ... UINT8_MAX] = &&LABEL_UNKNOWN,
+            [OP_RETURN] = &&LABEL_OP_RETURN,
+            [OP_JUMP_IF_FALSE] = &&LABEL_OP_JUMP_IF_FALSE,
+            [OP_JUMP] = &&LABEL_OP_JUMP,
+            [OP_LOOP] = &&LABEL_OP_LOOP,
+            [OP_POP_JUMP_IF_FALSE] = &&LABEL_OP_POP_JUMP_IF_FALSE,
+            [OP_JUMP_IF_NOT_LESS] = &&LABEL_OP_JUMP_IF_NOT_LESS,
+            [OP_JUMP_IF_NOT_LESS_EQUAL] = &&LABEL_OP_JUMP_IF_NOT_LESS_EQUAL,
+            [OP_JUMP_IF_NOT_GREATER] = &&LABEL_OP_JUMP_IF_NOT_GREATER,
+            [OP_JUMP_IF_NOT_GREATER_EQUAL] = &&LABEL_OP_JUMP_IF_NOT_GREATER_EQUAL,
+            [OP_JUMP_IF_NOT_EQUAL] = &&LABEL_OP_JUMP_IF_NOT_EQUAL,
+            [OP_JUMP_IF_EQUAL] = &&LABEL_OP_JUMP_IF_EQUAL,
+            [OP_ADD_LOCAL_CONST] = &&LABEL_OP_ADD_LOCAL_CONST,
+            [OP_CONSTANT] = &&LABEL_OP_CONSTANT,
+            [OP_DEFINE_GLOBAL] = &&LABEL_OP_DEFINE_GLOBAL,
+            [OP_GET_GLOBAL] = &&LABEL_OP_GET_GLOBAL,
+            [OP_SET_GLOBAL] = &&LABEL_OP_SET_GLOBAL,
+            [OP_SET_LOCAL] = &&LABEL_OP_SET_LOCAL,
+            [OP_GET_LOCAL] = &&LABEL_OP_GET_LOCAL,
+            [OP_POPN] = &&LABEL_OP_POPN,
+            [OP_CALL] = &&LABEL_OP_CALL,
+            [OP_CLASS] = &&LABEL_OP_CLASS,
+            [OP_SET_PROPERTY] = &&LABEL_OP_SET_PROPERTY,
+            [OP_GET_PROPERTY] = &&LABEL_OP_GET_PROPERTY,
+            [OP_METHOD] = &&LABEL_OP_METHOD,
+            [OP_INVOKE] = &&LABEL_OP_INVOKE,
+            [OP_NEGATE] = &&LABEL_OP_NEGATE,
+            [OP_ADD] = &&LABEL_OP_ADD,
+            [OP_SUB] = &&LABEL_OP_SUB,
+            [OP_MUL] = &&LABEL_OP_MUL,
+            [OP_DIV] = &&LABEL_OP_DIV,
+            [OP_NOT] = &&LABEL_OP_NOT,
+            [OP_EQUAL] = &&LABEL_OP_EQUAL,
+            [OP_GREATER] = &&LABEL_OP_GREATER,
+            [OP_LESSER] = &&LABEL_OP_LESSER,
+            [OP_PRINT] = &&LABEL_OP_PRINT,
+            [OP_POP] = &&LABEL_OP_POP,
+            [OP_TRUE] = &&LABEL_OP_TRUE,
+            [OP_FALSE] = &&LABEL_OP_FALSE,
+            [OP_NIL] = &&LABEL_OP_NIL,
+            [OP_NOT_EQUAL] = &&LABEL_OP_NOT_EQUAL,
+            [OP_LESS_EQUAL] = &&LABEL_OP_LESS_EQUAL,
+            [OP_GREATER_EQUAL] = &&LABEL_OP_GREATER_EQUAL,
+            [OP_ADD_NUM] = &&LABEL_OP_ADD_NUM,
+            [OP_ADD_STR] = &&LABEL_OP_ADD_STR,
+            [OP_CONSTANT_LONG] = &&LABEL_OP_CONSTANT_LONG,
+            [OP_DEFINE_GLOBAL_LONG] = &&LABEL_OP_DEFINE_GLOBAL_LONG,
+            [OP_GET_GLOBAL_LONG] = &&LABEL_OP_GET_GLOBAL_LONG,
+            [OP_SET_GLOBAL_LONG] = &&LABEL_OP_SET_GLOBAL_LONG,
+            [OP_CLASS_LONG] = &&LABEL_OP_CLASS_LONG,
+            [OP_METHOD_LONG] = &&LABEL_OP_METHOD_LONG,
+            [OP_SET_PROPERTY_LONG] = &&LABEL_OP_SET_PROPERTY_LONG,
+            [OP_GET_PROPERTY_LONG] = &&LABEL_OP_GET_PROPERTY_LONG,
+            [OP_INVOKE_LONG] = &&LABEL_OP_INVOKE_LONG,
+            [OP_JUMP_LONG] = &&LABEL_OP_JUMP_LONG,
+            [OP_JUMP_IF_FALSE_LONG] = &&LABEL_OP_JUMP_IF_FALSE_LONG,
+            [OP_LOOP_LONG] = &&LABEL_OP_LOOP_LONG,
+            [OP_GET_LOCAL_LONG] = &&LABEL_OP_GET_LOCAL_LONG,
+            [OP_SET_LOCAL_LONG] = &&LABEL_OP_SET_LOCAL_LONG,
+            [OP_TAIL_CALL] = &&LABEL_OP_TAIL_CALL,
+            [OP_TAIL_INVOKE] = &&LABEL_OP_TAIL_INVOKE,
+            [OP_TAIL_INVOKE_LONG] = &&LABEL_OP_TAIL_INVOKE_LONG,
+        };
+        #pragma GCC diagnostic pop
+        static void* dispatchTable[UINT8_MAX + 1];
+        for(int i = 0;i <= UINT8_MAX;i++){
+            dispatchTable[i] = vm.traceExecution?&&LABEL_TRACE:handlers[i];
+        }
+        // jumps to the handler of the next instruction
+        #define DISPATCH() goto *dispatchTable[READ_BYTE()]
+        // every handler is reachable both as a case of the switch and as a label of the table
+        #define CASE(op) LABEL_##op: case op
+
+        DISPATCH();
+
+        // runs in place of every handler while tracing
+        LABEL_TRACE:
+            frame->ip--;
+            traceInstruction(frame);
+            goto *handlers[READ_BYTE()];
+    #else
+        #define DISPATCH() break
+        #define CASE(op) case op
+    #endif
+
     for(;;){
-        #ifdef DEBUG_TRACE_EXECUTION
-            printf("              ");
-            for(Value *slot = vm.stack;slot < vm.stackTop;slot++){
-                printf("[");
-                printValue(*slot);
-                printf("]");
-            }
-            printf("\n");
-            disAssembleInstruction(&frame->function->chunk,(int)(frame->ip - frame->function->chunk.code));
+        #ifndef THREADED_DISPATCH
+            if(vm.traceExecution)traceInstruction(frame);
         #endif
         uint8_t code = READ_BYTE();
         switch(code){
-            case OP_POP:
+            CASE(OP_POP):
                 pop();
-                break;
-            case OP_RETURN:
+                DISPATCH();
+            CASE(OP_RETURN):{
                 Value result = pop();
                 vm.frameCount--;
                 if(vm.frameCount == 0){
@@ -334,185 +754,350 @@ InterpretResult run(){
                 vm.stackTop = frame->slots;
                 push(result);
                 frame = &vm.frames[vm.frameCount - 1];
-                break;
-            case OP_CONSTANT:
+                DISPATCH();
+            }
+            CASE(OP_CONSTANT):{
                 Value constant = READ_CONSTANT();
                 push(constant);
-                break;
-            case OP_NEGATE:
+                DISPATCH();
+            }
+            CASE(OP_CONSTANT_LONG):
+                push(frame->function->chunk.constants.values[READ_LONG()]);
+                DISPATCH();
+            CASE(OP_NEGATE):
                 if(!IS_NUM(peek(0))){
                     runtimeError("Operand should be a number");
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 push(NUM_VAL(-AS_NUM(pop())));
-                break;
-            case OP_ADD:
-                if(IS_STRING(peek(0)) && IS_STRING(peek(1))){
+                DISPATCH();
+            CASE(OP_ADD):
+                if(IS_ANY_STRING(peek(0)) && IS_ANY_STRING(peek(1))){
+                    QUICKEN(OP_ADD_STR);
                     concatenate();
                 }
                 else if(IS_NUM(peek(0)) && IS_NUM(peek(1))){
+                    QUICKEN(OP_ADD_NUM);
                     BINARY_OP(NUM_VAL,+);
                 }
                 else{
                     runtimeError("Operands should be either strings or numbers");
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                break;
-            case OP_SUB:
+                DISPATCH();
+            CASE(OP_ADD_NUM):{
+                if(!IS_NUM(peek(0)) || !IS_NUM(peek(1)))DESPECIALIZE(OP_ADD);
+                double b = AS_NUM(pop());
+                double a = AS_NUM(pop());
+                push(NUM_VAL(a + b));
+                DISPATCH();
+            }
+            CASE(OP_ADD_STR):
+                if(!IS_ANY_STRING(peek(0)) || !IS_ANY_STRING(peek(1)))DESPECIALIZE(OP_ADD);
+                concatenate();
+                DISPATCH();
+            CASE(OP_SUB):
                 BINARY_OP(NUM_VAL,-);
-                break;
-            case OP_MUL:
+                DISPATCH();
+            CASE(OP_MUL):
                 BINARY_OP(NUM_VAL,*);
-                break;
-            case OP_DIV:
+                DISPATCH();
+            CASE(OP_DIV):
                 BINARY_OP(NUM_VAL,/);
-                break;
-            case OP_NOT:
+                DISPATCH();
+            CASE(OP_NOT):
                 push(BOOL_VAL(isFalsey(pop())));
-                break;
-            case OP_TRUE:
+                DISPATCH();
+            CASE(OP_TRUE):
                 push(BOOL_VAL(true));
-                break;
-            case OP_FALSE:
+                DISPATCH();
+            CASE(OP_FALSE):
                 push(BOOL_VAL(false));
-                break;
-            case OP_NIL:
+                DISPATCH();
+            CASE(OP_NIL):
                 push(NIL_VAL);
-                break;
-            case OP_EQUAL:
+                DISPATCH();
+            CASE(OP_EQUAL):{
                 Value b = pop();
                 Value a = pop();
                 push(BOOL_VAL(areEqual(a,b)));
-                break;
-            case OP_GREATER:
+                DISPATCH();
+            }
+            CASE(OP_GREATER):
                 BINARY_OP(BOOL_VAL,>);
-                break;
-            case OP_LESSER:
+                DISPATCH();
+            CASE(OP_LESSER):
                 BINARY_OP(BOOL_VAL,<);
-                break;
-            case OP_PRINT:
+                DISPATCH();
+            CASE(OP_NOT_EQUAL):{
+                Value b = pop();
+                Value a = pop();
+                push(BOOL_VAL(!areEqual(a,b)));
+                DISPATCH();
+            }
+            // written as the negation the compiler emitted so NaN compares the same way
+            CASE(OP_LESS_EQUAL):
+                COMPARE_OP(!(a > b));
+                DISPATCH();
+            CASE(OP_GREATER_EQUAL):
+                COMPARE_OP(!(a < b));
+                DISPATCH();
+            CASE(OP_PRINT):
                 printValue(pop());
                 printf("\n");
-                break;
-            case OP_DEFINE_GLOBAL:{
-                ObjString*key = READ_STRING();
-                tableSet(&vm.globals,key,peek(0));
+                DISPATCH();
+            CASE(OP_DEFINE_GLOBAL_LONG):
+            CASE(OP_DEFINE_GLOBAL):{
+                uint32_t slot = READ_INDEX(OP_DEFINE_GLOBAL_LONG);
+                vm.globalValues.values[slot] = peek(0);
                 pop();
-                break;
+                DISPATCH();
             }
-            case OP_GET_GLOBAL:{
-                ObjString*key = READ_STRING();
-                Value value;
-                if(!tableGet(&vm.globals,key,&value)){
+            CASE(OP_GET_GLOBAL_LONG):
+            CASE(OP_GET_GLOBAL):{
+                uint32_t slot = READ_INDEX(OP_GET_GLOBAL_LONG);
+                Value value = vm.globalValues.values[slot];
+                if(IS_UNDEFINED(value)){
+                    ObjString*key = AS_STRING(vm.globalNames.values[slot]);
                     runtimeError("Undefined Variable : %.*s",key->length,key->chars);
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 push(value);
-                break;
+                DISPATCH();
             }
-            case OP_SET_GLOBAL:{
-                ObjString *key = READ_STRING();
-                if(tableSet(&vm.globals,key,peek(0))){
-                    tableDelete(&vm.globals,key);
+            CASE(OP_SET_GLOBAL_LONG):
+            CASE(OP_SET_GLOBAL):{
+                uint32_t slot = READ_INDEX(OP_SET_GLOBAL_LONG);
+                if(IS_UNDEFINED(vm.globalValues.values[slot])){
+                    ObjString*key = AS_STRING(vm.globalNames.values[slot]);
                     runtimeError("Undefined Variable : %.*s",key->length,key->chars);
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                break;
+                vm.globalValues.values[slot] = peek(0);
+                DISPATCH();
             }
-            case OP_GET_LOCAL:{
+            CASE(OP_GET_LOCAL):{
                 uint8_t slot = READ_BYTE();
                 push(frame->slots[slot]);
-                break;
+                DISPATCH();
             }
-            case OP_SET_LOCAL:{
+            CASE(OP_SET_LOCAL):{
                 uint8_t slot = READ_BYTE();
                 frame->slots[slot] = peek(0);
-                break;
+                DISPATCH();
             }
-            case OP_POPN:
+            CASE(OP_GET_LOCAL_LONG):
+                push(frame->slots[READ_LONG()]);
+                DISPATCH();
+            CASE(OP_SET_LOCAL_LONG):
+                frame->slots[READ_LONG()] = peek(0);
+                DISPATCH();
+            CASE(OP_POPN):{
                 uint8_t arg = READ_BYTE();
                 while(arg--){
                     pop();
                 }
-                break;
-            case OP_JUMP_IF_FALSE:{
+                DISPATCH();
+            }
+            CASE(OP_JUMP_IF_FALSE):{
                 uint16_t offset = READ_SHORT();
                 if(isFalsey(peek(0))){
                     frame->ip += offset;
                 }
-                break;
+                DISPATCH();
             }
-            case OP_JUMP:{
+            CASE(OP_JUMP):{
                 uint16_t offset = READ_SHORT();
                 frame->ip += offset;
-                break;
+                DISPATCH();
             }
-            case OP_LOOP:{
+            CASE(OP_LOOP):{
                 uint16_t offset = READ_SHORT();
                 frame->ip -= offset;
-                break;
+                SAFEPOINT();
+                DISPATCH();
+            }
+            CASE(OP_JUMP_LONG):{
+                uint32_t offset = READ_LONG();
+                frame->ip += offset;
+                DISPATCH();
             }
-            case OP_CALL:{
+            CASE(OP_JUMP_IF_FALSE_LONG):{
+                uint32_t offset = READ_LONG();
+                if(isFalsey(peek(0))){
+                    frame->ip += offset;
+                }
+                DISPATCH();
+            }
+            CASE(OP_LOOP_LONG):{
+                uint32_t offset = READ_LONG();
+                frame->ip -= offset;
+                SAFEPOINT();
+                DISPATCH();
+            }
+            CASE(OP_POP_JUMP_IF_FALSE):{
+                uint16_t offset = READ_SHORT();
+                if(isFalsey(pop())){
+                    frame->ip += offset;
+                }
+                DISPATCH();
+            }
+            CASE(OP_JUMP_IF_NOT_LESS):
+                BRANCH_OP(!(a < b));
+                DISPATCH();
+            CASE(OP_JUMP_IF_NOT_LESS_EQUAL):
+                BRANCH_OP(a > b);
+                DISPATCH();
+            CASE(OP_JUMP_IF_NOT_GREATER):
+                BRANCH_OP(!(a > b));
+                DISPATCH();
+            CASE(OP_JUMP_IF_NOT_GREATER_EQUAL):
+                BRANCH_OP(a < b);
+                DISPATCH();
+            CASE(OP_JUMP_IF_NOT_EQUAL):{
+                uint16_t offset = READ_SHORT();
+                Value b = pop();
+                Value a = pop();
+                if(!areEqual(a,b))frame->ip += offset;
+                DISPATCH();
+            }
+            CASE(OP_JUMP_IF_EQUAL):{
+                uint16_t offset = READ_SHORT();
+                Value b = pop();
+                Value a = pop();
+                if(areEqual(a,b))frame->ip += offset;
+                DISPATCH();
+            }
+            CASE(OP_ADD_LOCAL_CONST):{
+                Value*local = &frame->slots[READ_BYTE()];
+                Value constant = READ_CONSTANT();
+                if(!IS_NUM(*local)){
+                    runtimeError("Operands should be either strings or numbers");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                *local = NUM_VAL(AS_NUM(*local) + AS_NUM(constant));
+                DISPATCH();
+            }
+            CASE(OP_CALL):{
+                SAFEPOINT();
                 uint8_t argCount = READ_BYTE();
                 if(!callValue(peek(argCount),argCount)){
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 frame = &vm.frames[vm.frameCount - 1];
-                break;
+                DISPATCH();
             }
-            case OP_CLASS:{
-                push(OBJ_VAL(newClass(READ_STRING())));
-                break;
+            CASE(OP_CLASS_LONG):
+            CASE(OP_CLASS):{
+                push(OBJ_VAL(newClass(READ_NAME(OP_CLASS_LONG))));
+                DISPATCH();
             }
-            case OP_SET_PROPERTY : {
+            CASE(OP_SET_PROPERTY_LONG):
+            CASE(OP_SET_PROPERTY) : {
                 if(!IS_INSTANCE(peek(1))){
                     runtimeError("Only Instances are allowed to have fields");
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                ObjString*field = READ_STRING();
+                bool isLong = frame->ip[-1] == OP_SET_PROPERTY_LONG;
+                ObjString*field = READ_NAME(OP_SET_PROPERTY_LONG);
+                InlineCache*cache = READ_CACHE(isLong);
                 ObjInstance*instance = AS_INSTANCE(peek(1));
-                tableSet(&instance->fields,field,peek(0));
+                CacheEntry*entry = findCacheEntry(cache,instance->shape);
+                if(entry == NULL || entry->method != NULL){
+                    setProperty(instance,field,cache);
+                }
+                else if(entry->transition != NULL){
+                    instanceAddField(instance,entry->transition,peek(0));
+                }
+                else{
+                    WRITE_BARRIER(&instance->obj,peek(0));
+                    SHADE(instance->fields[entry->slot]);
+                    instance->fields[entry->slot] = peek(0);
+                }
                 Value value = pop();
                 pop();
                 push(value);
-                break;
+                DISPATCH();
             }
-            case OP_GET_PROPERTY : {
+            CASE(OP_GET_PROPERTY_LONG):
+            CASE(OP_GET_PROPERTY) : {
                 if(!IS_INSTANCE(peek(0))){
                     runtimeError("Only Instances are allowed to have fields");
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                ObjString*name = READ_STRING();
+                bool isLong = frame->ip[-1] == OP_GET_PROPERTY_LONG;
+                ObjString*name = READ_NAME(OP_GET_PROPERTY_LONG);
+                InlineCache*cache = READ_CACHE(isLong);
                 ObjInstance*instance = AS_INSTANCE(peek(0));
-                Value value;
-                if(tableGet(&instance->fields,name,&value)){
+                CacheEntry*entry = findCacheEntry(cache,instance->shape);
+                if(entry != NULL){
+                    if(entry->method == NULL){
+                        pop();
+                        push(instance->fields[entry->slot]);
+                        DISPATCH();
+                    }
+                    ObjBoundMethod*boundMethod = newBoundMethod(entry->method,peek(0));
                     pop();
-                    push(value);
-                    break;
+                    push(OBJ_VAL(boundMethod));
+                    DISPATCH();
                 }
 
-                if(!bindMethod(instance->klass,name)){
-                    runtimeError("Undefined method or field");
+                if(!getProperty(instance,name,cache)){
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                break;
+                DISPATCH();
             }
-            case OP_METHOD:{
-                ObjString*name = READ_STRING();
+            CASE(OP_METHOD_LONG):
+            CASE(OP_METHOD):{
+                ObjString*name = READ_NAME(OP_METHOD_LONG);
                 ObjClass*klass = AS_CLASS(peek(1));
+                WRITE_BARRIER_OBJ(&klass->obj,name);
+                WRITE_BARRIER(&klass->obj,peek(0));
                 tableSet(&klass->methods,name,peek(0));
                 pop();
-                break;
+                DISPATCH();
             }
-            case OP_INVOKE:{
-                ObjString*name = READ_STRING();
+            CASE(OP_INVOKE_LONG):
+            CASE(OP_INVOKE):{
+                SAFEPOINT();
+                bool isLong = frame->ip[-1] == OP_INVOKE_LONG;
+                ObjString*name = READ_NAME(OP_INVOKE_LONG);
                 uint8_t argCount = READ_BYTE();
-                if(!invokeMethod(name,argCount)){
+                if(!invoke(name,argCount,READ_CACHE(isLong))){
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 frame = &vm.frames[vm.frameCount - 1];
-                break;
+                DISPATCH();
+            }
+            // natives and classes without an initializer push no frame, the OP_RETURN after the call returns their result
+            CASE(OP_TAIL_CALL):{
+                SAFEPOINT();
+                uint8_t argCount = READ_BYTE();
+                int frameCount = vm.frameCount;
+                if(!callValue(peek(argCount),argCount)){
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                if(vm.frameCount > frameCount)replaceCallerFrame();
+                frame = &vm.frames[vm.frameCount - 1];
+                DISPATCH();
+            }
+            CASE(OP_TAIL_INVOKE_LONG):
+            CASE(OP_TAIL_INVOKE):{
+                SAFEPOINT();
+                bool isLong = frame->ip[-1] == OP_TAIL_INVOKE_LONG;
+                ObjString*name = READ_NAME(OP_TAIL_INVOKE_LONG);
+                uint8_t argCount = READ_BYTE();
+                int frameCount = vm.frameCount;
+                if(!invoke(name,argCount,READ_CACHE(isLong))){
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                if(vm.frameCount > frameCount)replaceCallerFrame();
+                frame = &vm.frames[vm.frameCount - 1];
+                DISPATCH();
             }
+            #ifdef THREADED_DISPATCH
+            LABEL_UNKNOWN:
+            #endif
             default:
                 return INTERPRET_RUNTIME_ERROR;
         }
@@ -522,19 +1107,54 @@ InterpretResult run(){
     #undef READ_BYTE
     #undef READ_CONSTANT
     #undef BINARY_OP
+    #undef COMPARE_OP
+    #undef BRANCH_OP
+    #undef QUICKEN
+    #undef DESPECIALIZE
+    #undef SAFEPOINT
     #undef READ_STRING
     #undef READ_SHORT
+    #undef READ_CACHE
+    #undef READ_LONG
+    #undef READ_INDEX
+    #undef READ_NAME
+    #undef DISPATCH
+    #undef CASE
 }
 
 
+void outOfMemory(size_t size){
+    if(!canUnwind){
+        fprintf(stderr,"Out of memory\n");
+        exit(1);
+    }
+    if(vm.gcMaxHeap != 0 && vm.bytesAllocated + size > vm.gcMaxHeap){
+        runtimeError("Out of memory: %zu more bytes would exceed the heap limit of %zu bytes",size,vm.gcMaxHeap);
+    }
+    else{
+        runtimeError("Out of memory: could not allocate %zu bytes",size);
+    }
+    longjmp(errorJump,1);
+}
+
 InterpretResult interpret(const char*source){
+    // the collector and the objects are left consistent by an allocation failing, only the C stack is dropped
+    if(setjmp(errorJump) != 0){
+        canUnwind = false;
+        abandonCompilation();
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    canUnwind = true;
 
     ObjFunction *function = compile(source);
     if(function == NULL){
+        canUnwind = false;
         return INTERPRET_COMPILE_ERROR;
     }    
     push(OBJ_VAL(function));
     call(function,0);
 
-    return run();
+    InterpretResult result = run();
+    canUnwind = false;
+    return result;
 }
@@ -3,11 +3,18 @@
 #include "chunk.h"
 #include "value.h"
 #include "table.h"
+#include "allocator.h"
 
-// specifies max number of callFrames 
-#define FRAME_MAX 64
-// specifies max size of the VM stack
-#define STACK_SIZE (FRAME_MAX * UINT8_MAX)
+// number of callFrames and stack slots the VM starts with, both arrays grow on demand
+#define FRAMES_INITIAL 64
+#define STACK_INITIAL 256
+// slots kept free above every frame's maxStack and above a native's arguments, for the values the VM roots on the
+// stack while it allocates (concatenateRope(), newClass(), shapeTransition(), gcStats()...)
+#define STACK_HEADROOM 8
+// default max number of callFrames, can be changed with --max-frames
+#define FRAME_MAX (1 << 20)
+// number of frames at each end of the call stack a runtime error prints
+#define TRACE_FRAMES 16
 
 
 /*
@@ -20,36 +27,125 @@ typedef struct{
     uint8_t*ip;
     // pointer to stack slots local to the function
     Value *slots;
+    // number of frames tail calls have replaced with this one
+    int elided;
 }CallFrame;
 
+// phase of the incremental collector
+typedef enum{
+    GC_IDLE,
+    // gray objects are traced a slice at a time, the mutator runs between slices
+    GC_MARKING,
+    // the object pages' bitmaps are scanned for unmarked objects a slice at a time
+    GC_SWEEPING
+}GcState;
+
+// what the collector did so far, reported by gcStats()
+typedef struct{
+    // major cycles finished and minor collections
+    int cycles;
+    int minorCollections;
+    // time the mutator spent stopped in the collector, in total and the longest stop, in microseconds
+    double pauseTotal;
+    double pauseMax;
+    // bytes of garbage objects freed by sweeps and left behind in the nursery, not counting the arrays they owned
+    size_t bytesFreed;
+}GcStats;
+
 // struct for the virtual machine 
 typedef struct {
     // array of vm's callframes
-    CallFrame frames[FRAME_MAX];
+    CallFrame *frames;
     // current number of frames
     int frameCount;
+    // number of frames allocated
+    int frameCapacity;
+    // calls deeper than this are a stack overflow
+    int maxFrames;
     // stack
-    Value stack[STACK_SIZE];
+    Value *stack;
+    // number of slots allocated for the stack
+    int stackCapacity;
     // pointer to top of the stack
     Value *stackTop;
-    // pointer to linked list of dynamically allocated objects
-    Obj*objects;
     // Hashset of interned strings
     Table strings;
-    // Hashmap of global variables
-    Table globals;
+    // global variable names -> their slot in globalValues, slots are handed out by the compiler
+    Table globalSlots;
+    // values of the global variables, UNDEFINED_VAL until the variable is defined
+    ValueArray globalValues;
+    // names of the global variables by slot
+    ValueArray globalNames;
     // array of gray objects for the garbage collector
     Obj**grayStack; 
     // current number of gray Objects
     int grayCount;
     // capacity of grayStack
     int grayCapacity;
+    // space new objects are bump allocated in, NURSERY_SIZE bytes
+    uint8_t*nursery;
+    // where the next young object goes
+    uint8_t*nurseryTop;
+    // set once an object didn't fit in the nursery, run() collects it at its next safe point
+    bool nurseryFull;
+    // set while collectNursery() runs, full collections wait until it is done
+    bool collectingNursery;
+    // old objects that may hold references to young ones
+    Obj**remembered;
+    int rememberedCount;
+    int rememberedCapacity;
+    // interned strings still in the nursery, vm.strings only holds them weakly
+    ObjString**youngStrings;
+    int youngStringCount;
+    int youngStringCapacity;
+    GcState gcState;
+    // mark bits of the young objects
+    uint64_t*nurseryMarks;
+    // longest a collection slice may run in microseconds, 0 collects the whole heap at once
+    long gcPause;
+    // bytes allocated since the last slice
+    size_t gcDebt;
+    // marking runs on a helper thread instead of in slices, set with --gc-concurrent
+    bool gcConcurrent;
+    // the helper thread is marking, structural changes to objects it may read take the heap lock
+    bool markerRunning;
+    // threads sweeping the object pages next to the mutator, set with --gc-sweep-threads
+    int gcSweepThreads;
+    // sweeper threads are running, the allocator is only used under its lock
+    bool sweepersRunning;
+    // fragmented object pages are compacted once a cycle is over, set with --gc-compact
+    bool gcCompact;
+    // the last cycle left the object pages fragmented, the next safe point compacts them
+    bool compactPending;
     // amount of currently allocated memory
     size_t bytesAllocated;
     // memory threshold at which the garbage collector will run
     size_t nextGC;
+    // once a cycle is over the next one starts when the heap grew gcGrowth times, set with --gc-growth
+    double gcGrowth;
+    // the heap never grows past this many bytes, allocating more is an out of memory error. 0 for no limit,
+    // set with --gc-max-heap
+    size_t gcMaxHeap;
+    // at least this many bytes are allocated between two cycles, set with --gc-min-interval
+    size_t gcMinInterval;
+    // prints a line to stderr for each collection, set with --gc-log
+    bool gcLog;
+    GcStats gcStats;
 
     ObjString*initString;
+    // class of the instances gcStats() returns, made once so they all share the same shapes
+    ObjClass*gcStatsClass;
+
+    // runtime debugging options, set from the command line or the environment in main.c
+    // prints the stack and every instruction before executing it
+    bool traceExecution;
+    // when set only the opcodes marked in traceOps are traced
+    bool traceOpsOnly;
+    bool traceOps[UINT8_MAX + 1];
+    // when not NULL only instructions of functions with this name are traced ("main" for top level code)
+    const char*traceFunction;
+    // disassembles every function once it has been compiled
+    bool printCode;
 }VM;
 
 // exporting the VM to other files
@@ -63,6 +159,12 @@ void freeVM();
 void push(Value value);
 // popping a value from the top of the stack
 Value pop();
+// returns the slot of the global variable with this name, adding one if needed
+int globalSlot(ObjString*name);
+// nil and false are falsey, every other value is truthy
+bool isFalsey(Value value);
+// equality as done by OP_EQUAL
+bool areEqual(Value a,Value b);
 
 
 // enum for different types of results returned by the interpreter
@@ -75,8 +177,15 @@ typedef enum{
 
 // interprets the given source code
 InterpretResult interpret(const char*source);
+/*
+    reports that an allocation of size bytes failed or would cross vm.gcMaxHeap and unwinds to interpret(),
+    which returns INTERPRET_RUNTIME_ERROR. Outside of interpret() it exits.
+*/
+void outOfMemory(size_t size);
 
 // frees an object
 void freeObject(Obj*obj);
+// frees the arrays and tables an object owns but not the object itself
+void freeObjectContents(Obj*obj);
 
 #endif
\ No newline at end of file